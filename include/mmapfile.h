@@ -0,0 +1,109 @@
+#ifndef INCLUDE_MMAPFILE_H
+#define INCLUDE_MMAPFILE_H
+
+#include "unishim_split.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// read-only view of a whole file
+struct mappedfile {
+    unsigned char * data = nullptr;
+    size_t size = 0;
+    #ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    #endif
+};
+
+static bool wrap_mmap(const char * fname, mappedfile * m)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    m->file = CreateFileW((wchar_t *)wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    
+    free(wpath);
+    
+    if(m->file == INVALID_HANDLE_VALUE) return false;
+    
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(m->file, &size) or size.QuadPart == 0)
+    {
+        CloseHandle(m->file);
+        m->file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    m->size = size.QuadPart;
+    
+    m->mapping = CreateFileMappingW(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(m->mapping)
+        m->data = (unsigned char *)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!m->data)
+    {
+        if(m->mapping) CloseHandle(m->mapping);
+        CloseHandle(m->file);
+        m->mapping = NULL;
+        m->file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    return true;
+    
+    #else
+    
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0) return false;
+    
+    struct stat info;
+    if(fstat(fd, &info) != 0 or info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+    m->size = info.st_size;
+    
+    void * data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if(data == MAP_FAILED) return false;
+    
+    m->data = (unsigned char *)data;
+    return true;
+    
+    #endif
+}
+
+static void wrap_munmap(mappedfile * m)
+{
+    if(!m->data) return;
+    
+    #ifdef _WIN32
+    
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+    m->mapping = NULL;
+    m->file = INVALID_HANDLE_VALUE;
+    
+    #else
+    
+    munmap(m->data, m->size);
+    
+    #endif
+    
+    m->data = nullptr;
+    m->size = 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef INCLUDE_OCR_H
+#define INCLUDE_OCR_H
+
+#include <stddef.h>
+#include <string>
+#include <atomic>
+
+// running OCR scripts (ocr.cpp)
+
+// limits for one OCR run; the cancel flag can be set from any thread while the run is in progress
+struct ocrlimits {
+    double timeout = 0; // wall clock seconds for the whole script, 0 for no limit
+    std::atomic<bool> * cancel = nullptr;
+};
+
+// scripts that don't mention $SCREENSHOT or $OUTPUTFILE read the image from stdin and write the text to stdout instead
+bool ocr_wants_files(const char * commandfilename);
+
+// runs the script line by line after filling in the variables; the script reads filename and writes outfilename
+// returns the last line's exit code like sh would, or nonzero if the script timed out or was cancelled
+int ocr(const char * filename, const char * commandfilename, const char * outfilename, const char * scale, const char * xshear, const char * yshear, const ocrlimits & limits = ocrlimits());
+
+// runs the whole script with the encoded image on its stdin, collecting its stdout into output
+// scripts starting with "server:" instead hand the image to a long-running engine
+// returns nonzero if the script couldn't be started, failed, timed out, or was cancelled
+int ocr_piped(const char * commandfilename, const unsigned char * input, size_t inputlen, std::string * output, const char * scale, const char * xshear, const char * yshear, const ocrlimits & limits = ocrlimits());
+
+#endif
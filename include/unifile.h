@@ -22,3 +22,157 @@ static FILE * wrap_fopen(const char * fname, const char * mode)
     
     #endif
 }
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <utime.h>
+#include <unistd.h>
+#endif
+
+// size and modification time of a file, returns false if it doesn't exist
+static bool wrap_stat(const char * fname, uint64_t * size, int64_t * mtime)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    struct _stat64 info;
+    int r = _wstat64((wchar_t *)wpath, &info);
+    
+    free(wpath);
+    
+    #else
+    
+    struct stat info;
+    int r = stat(fname, &info);
+    
+    #endif
+    
+    if(r != 0) return false;
+    if(size) *size = info.st_size;
+    if(mtime) *mtime = info.st_mtime;
+    return true;
+}
+
+static bool wrap_mkdir(const char * fname)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    int r = _wmkdir((wchar_t *)wpath);
+    
+    free(wpath);
+    
+    return r == 0;
+    
+    #else
+    
+    return mkdir(fname, 0755) == 0;
+    
+    #endif
+}
+
+static bool wrap_remove(const char * fname)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    int r = _wremove((wchar_t *)wpath);
+    
+    free(wpath);
+    
+    return r == 0;
+    
+    #else
+    
+    return remove(fname) == 0;
+    
+    #endif
+}
+
+// replaces the destination if it exists
+static bool wrap_rename(const char * from, const char * to)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wfrom = utf8_to_utf16((uint8_t *)from, &status);
+    uint16_t * wto = utf8_to_utf16((uint8_t *)to, &status);
+    
+    bool r = false;
+    if(wfrom and wto)
+        r = MoveFileExW((wchar_t *)wfrom, (wchar_t *)wto, MOVEFILE_REPLACE_EXISTING);
+    
+    free(wfrom);
+    free(wto);
+    
+    return r;
+    
+    #else
+    
+    return rename(from, to) == 0;
+    
+    #endif
+}
+
+// sets the modification time to now
+static bool wrap_touch(const char * fname)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    int r = _wutime((wchar_t *)wpath, NULL);
+    
+    free(wpath);
+    
+    return r == 0;
+    
+    #else
+    
+    return utime(fname, NULL) == 0;
+    
+    #endif
+}
+
+// cuts the file down to length bytes in place, so anything that has it open keeps seeing the same file
+static bool wrap_truncate(const char * fname, uint64_t length)
+{
+    #ifdef _WIN32
+    
+    int status;
+    uint16_t * wpath = utf8_to_utf16((uint8_t *)fname, &status);
+    if(!wpath) return false;
+    
+    int fd = _wopen((wchar_t *)wpath, _O_RDWR | _O_BINARY);
+    free(wpath);
+    if(fd < 0) return false;
+    
+    bool r = _chsize_s(fd, length) == 0;
+    _close(fd);
+    
+    return r;
+    
+    #else
+    
+    return truncate(fname, length) == 0;
+    
+    #endif
+}
@@ -0,0 +1,159 @@
+#ifndef INCLUDE_ZIPFILE_H
+#define INCLUDE_ZIPFILE_H
+
+#include "mmapfile.h"
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// minimal reader for the central directory of .zip/.cbz files
+// entries are read straight out of a read-only mapping of the archive; inflating deflated entries is up to the caller
+
+struct zipentry {
+    std::string name;
+    uint16_t method; // 0: stored, 8: deflated
+    uint32_t crc;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t local_header_offset;
+};
+
+struct ziparchive {
+    mappedfile file;
+    std::vector<zipentry> entries;
+};
+
+static uint16_t zip_u16(const unsigned char * p)
+{
+    return p[0] | (p[1] << 8);
+}
+static uint32_t zip_u32(const unsigned char * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+static uint64_t zip_u64(const unsigned char * p)
+{
+    return zip_u32(p) | (uint64_t(zip_u32(p+4)) << 32);
+}
+
+static void zip_close(ziparchive * zip)
+{
+    wrap_munmap(&zip->file);
+    zip->entries.clear();
+}
+
+// returns false if the file isn't a zip archive we can read
+static bool zip_open(const char * fname, ziparchive * zip)
+{
+    if(!wrap_mmap(fname, &zip->file)) return false;
+
+    auto data = zip->file.data;
+    size_t size = zip->file.size;
+
+    // the end of central directory record is at the end of the file, followed by a comment of up to 64KiB
+    if(size < 22)
+    {
+        zip_close(zip);
+        return false;
+    }
+    size_t eocd = size - 22;
+    size_t lowest = (size > 22 + 0xFFFF) ? size - 22 - 0xFFFF : 0;
+    while(zip_u32(data + eocd) != 0x06054b50)
+    {
+        if(eocd == lowest)
+        {
+            zip_close(zip);
+            return false;
+        }
+        eocd--;
+    }
+
+    uint64_t count = zip_u16(data + eocd + 10);
+    uint64_t cd_offset = zip_u32(data + eocd + 16);
+
+    // zip64 archives keep the real values in another record, found through a locator right before this one
+    if((cd_offset == 0xFFFFFFFF or count == 0xFFFF) and eocd >= 20 and zip_u32(data + eocd - 20) == 0x07064b50)
+    {
+        uint64_t eocd64 = zip_u64(data + eocd - 20 + 8);
+        if(eocd64 + 56 <= size and zip_u32(data + eocd64) == 0x06064b50)
+        {
+            count = zip_u64(data + eocd64 + 32);
+            cd_offset = zip_u64(data + eocd64 + 48);
+        }
+    }
+
+    uint64_t p = cd_offset;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        if(p + 46 > size or zip_u32(data + p) != 0x02014b50)
+            break;
+
+        auto rec = data + p;
+        uint16_t flags = zip_u16(rec + 8);
+        zipentry entry;
+        entry.method = zip_u16(rec + 10);
+        entry.crc = zip_u32(rec + 16);
+        entry.compressed_size = zip_u32(rec + 20);
+        entry.size = zip_u32(rec + 24);
+        uint16_t namelen = zip_u16(rec + 28);
+        uint16_t extralen = zip_u16(rec + 30);
+        uint16_t commentlen = zip_u16(rec + 32);
+        entry.local_header_offset = zip_u32(rec + 42);
+
+        if(p + 46 + namelen + extralen + commentlen > size)
+            break;
+        entry.name = std::string((const char *)rec + 46, namelen);
+
+        // zip64 extended information: 64-bit versions of whichever fields were saturated, in this order
+        auto extra = rec + 46 + namelen;
+        for(size_t e = 0; e + 4 <= extralen;)
+        {
+            uint16_t id = zip_u16(extra + e);
+            uint16_t len = zip_u16(extra + e + 2);
+            if(id == 0x0001)
+            {
+                size_t f = e + 4;
+                // a sub-field that claims to be longer than the extra field it's in only gets what's actually there
+                size_t end = std::min<size_t>(e + 4 + len, extralen);
+                if(entry.size == 0xFFFFFFFF and f + 8 <= end)
+                    entry.size = zip_u64(extra + f), f += 8;
+                if(entry.compressed_size == 0xFFFFFFFF and f + 8 <= end)
+                    entry.compressed_size = zip_u64(extra + f), f += 8;
+                if(entry.local_header_offset == 0xFFFFFFFF and f + 8 <= end)
+                    entry.local_header_offset = zip_u64(extra + f), f += 8;
+            }
+            e += 4 + len;
+        }
+
+        p += 46 + namelen + extralen + commentlen;
+
+        // skip directories and encrypted entries
+        if(entry.name.length() == 0 or entry.name[entry.name.length()-1] == '/' or (flags & 1))
+            continue;
+        zip->entries.push_back(entry);
+    }
+
+    return true;
+}
+
+// the entry's data as stored in the archive (compressed if method isn't 0), or nullptr if the archive is damaged
+static const unsigned char * zip_entry_data(ziparchive * zip, const zipentry & entry)
+{
+    auto data = zip->file.data;
+    size_t size = zip->file.size;
+    uint64_t p = entry.local_header_offset;
+
+    // written as subtractions, since zip64 offsets and sizes near 2^64 would wrap around when added to
+    if(p > size or size - p < 30 or zip_u32(data + p) != 0x04034b50)
+        return nullptr;
+
+    // the local header can have a different extra field than the central directory
+    uint64_t start = p + 30 + zip_u16(data + p + 26) + zip_u16(data + p + 28);
+    if(start > size or entry.compressed_size > size - start)
+        return nullptr;
+
+    return data + start;
+}
+
+#endif
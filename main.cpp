@@ -18,7 +18,12 @@ limitations under the License.
 
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include <locale.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #ifndef M_PI
 #define M_PI 3.1415926435
 #endif
@@ -32,19 +37,31 @@ limitations under the License.
 
 #include "include/unishim_split.h"
 #include "include/unifile.h"
+#include "include/ocr.h"
+#include "include/mmapfile.h"
+#include "include/zipfile.h"
 
 #ifdef _WIN32
 #include "include/dirent_emulation.h"
+#include <process.h>
 #else
 #include <dirent.h>
 #include <unistd.h>
+#include <signal.h>
 #endif
 
 #include <mutex>
 #include <thread>
+#include <condition_variable>
 #include <chrono>
 #include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <functional>
 #include <map>
+#include <set>
 #include <string>
 #include <algorithm>
 
@@ -59,6 +76,14 @@ struct colorvertex {
     float x, y, z, r, g, b, a;
 };
 
+// one quad of region overlay; corners are in image space, offsets in screen pixels
+struct outlineinstance {
+    float corners[8]; // top left, top right, bottom left, bottom right
+    float offsets[4]; // left x, right x, top y, bottom y
+    float r, g, b, a;
+    float clip[4]; // x1, y1, x2, y2 in image space
+};
+
 void checkerr(int line)
 {
     GLenum err;
@@ -167,6 +192,18 @@ MAKEREAL(speed, 2000);
 MAKEREAL(scrollspeed, 100);
 MAKEREAL(throttle, 0.004);
 MAKEREAL(fastgl, 0);
+MAKEREAL(decode_threads, 2);
+MAKEREAL(prefetch_pages, 2);
+MAKEREAL(page_cache_bytes, 512*1024*1024);
+MAKEREAL(upload_bytes_per_frame, 8*1024*1024);
+MAKEREAL(tile_size, 4096);
+MAKEREAL(disk_cache_bytes, 0);
+MAKEREAL(ocr_threads, 2);
+MAKEREAL(ocr_cache, 1);
+MAKEREAL(ocr_timeout, 120);
+MAKEREAL(ocr_preprocess, 0);
+MAKEREAL(propose_regions, 0);
+MAKEREAL(speculative_ocr, 0);
 
 #define MAKETEXT(X, Y) conf_text X(#X, Y)
 
@@ -181,16 +218,131 @@ float sharpblur2 = 0.5;
 float sharpradius1 = 8.0;
 float sharpradius2 = 16.0;
 
+// pixels of a page decoded off the render thread, not yet uploaded
+struct decodedimage {
+    unsigned char * data = nullptr;
+    int w = 0, h = 0, n = 0;
+    // set if data points into a file from the on-disk page cache instead of being from stb_image
+    mappedfile * mapping = nullptr;
+};
+
+void release_image(decodedimage & img)
+{
+    if(img.mapping)
+    {
+        wrap_munmap(img.mapping);
+        delete img.mapping;
+    }
+    else
+        stbi_image_free(img.data);
+    img.data = nullptr;
+    img.mapping = nullptr;
+}
+
+// converts stb_image output with any channel count to what gets uploaded:
+// one byte per pixel for pages that are entirely gray and opaque, RGBA for everything else
+decodedimage to_upload_format(decodedimage img)
+{
+    if(!img.data or img.n == 1) return img;
+    
+    size_t count = size_t(img.w)*img.h;
+    auto p = img.data;
+    bool gray = true;
+    for(size_t i = 0; i < count and gray; i++, p += img.n)
+    {
+        if(img.n == 2)
+            gray = p[1] == 255;
+        else if(img.n == 3)
+            gray = p[0] == p[1] and p[1] == p[2];
+        else
+            gray = p[0] == p[1] and p[1] == p[2] and p[3] == 255;
+    }
+    
+    if(gray)
+    {
+        // shrinking in place is safe because the write position never passes the read position
+        for(size_t i = 0; i < count; i++)
+            img.data[i] = img.data[i*img.n];
+        img.n = 1;
+        puts("page is grayscale");
+        return img;
+    }
+    if(img.n == 4)
+        return img;
+    
+    auto rgba = (unsigned char *)malloc(count*4);
+    if(!rgba)
+    {
+        stbi_image_free(img.data);
+        img.data = nullptr;
+        return img;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        auto src = img.data + i*img.n;
+        if(img.n == 2)
+        {
+            rgba[i*4+0] = rgba[i*4+1] = rgba[i*4+2] = src[0];
+            rgba[i*4+3] = src[1];
+        }
+        else
+        {
+            rgba[i*4+0] = src[0];
+            rgba[i*4+1] = src[1];
+            rgba[i*4+2] = src[2];
+            rgba[i*4+3] = 255;
+        }
+    }
+    stbi_image_free(img.data);
+    img.data = rgba;
+    img.n = 4;
+    return img;
+}
+
+// does no GL work, so it's safe to call from decoder threads
+decodedimage decode_image(const char * filename);
+
+// 2*J1(pi*x)/(pi*x), the radial counterpart of sinc; 1 at x = 0
+double jinc(double x)
+{
+    if(x == 0)
+        return 1;
+    #ifdef _WIN32
+    return 2*std::cyl_bessel_j(1, x*M_PI)/(x*M_PI);
+    #else
+    return 2*j1(x*M_PI)/(x*M_PI);
+    #endif
+}
+// jinc tapered to zero at radius by a cosine window, which is what the downscaling filters weight taps with
+double jinc_window(double x, double radius)
+{
+    if(x > radius)
+        return 0;
+    return jinc(x)*cos(x*M_PI/2/radius);
+}
+
 struct renderer {
     float cam_x = 0;
     float cam_y = 0;
     float cam_scale = 0;
     // TODO: FIXME: add a real reference counter
     struct texture {
+        // part of the image with its own GL texture; pages bigger than the tile size get split into a grid of these
+        struct tile {
+            GLuint texid = 0;
+            int x, y, w, h; // area of mydata stored in texid, including the overlap with neighboring tiles
+            int core_x, core_y, core_w, core_h; // area of the image this tile is responsible for drawing
+            // rows that are in texid so far; streamed tiles get filled in over several frames by pump_uploads()
+            int uploaded_rows = 0;
+            // mip levels past the base that are in texid so far, streamed tiles get those one level at a time too
+            int mip_levels = 0;
+        };
         int w, h, n;
-        GLuint texid;
         unsigned char * mydata;
-        texture(unsigned char * data, int w, int h, bool ismono = false)
+        mappedfile * mymapping = nullptr;
+        std::vector<tile> tiles;
+        bool tiled = false;
+        texture(unsigned char * data, int w, int h, bool ismono = false, int tilesize = 0, int overlap = 0)
         {
             mydata = data;
             this->w = w;
@@ -200,61 +352,284 @@ struct renderer {
             else
                 this->n = 4;
             
+            printf("Actual size: %dx%d\n", this->w, this->h);
+            
+            if(tilesize <= 0 or (w <= tilesize and h <= tilesize))
+            {
+                tile t;
+                t.x = t.core_x = 0;
+                t.y = t.core_y = 0;
+                t.w = t.core_w = w;
+                t.h = t.core_h = h;
+                tiles.push_back(t);
+            }
+            else
+            {
+                tiled = true;
+                // keep tile offsets even so that mip level 1 of a tile lines up with mip level 1 of the whole image
+                int core = (tilesize - overlap*2) & ~1;
+                for(int y = 0; y < h; y += core)
+                {
+                    for(int x = 0; x < w; x += core)
+                    {
+                        tile t;
+                        t.core_x = x;
+                        t.core_y = y;
+                        t.core_w = std::min(core, w-x);
+                        t.core_h = std::min(core, h-y);
+                        t.x = std::max(0, x-overlap);
+                        t.y = std::max(0, y-overlap);
+                        t.w = std::min(w, x+t.core_w+overlap) - t.x;
+                        t.h = std::min(h, y+t.core_h+overlap) - t.y;
+                        tiles.push_back(t);
+                    }
+                }
+                printf("Split into %d tiles\n", int(tiles.size()));
+            }
+        }
+        ~texture()
+        {
+            decodedimage img;
+            img.data = mydata;
+            img.mapping = mymapping;
+            release_image(img);
+        }
+        // creates the GL texture for a tile, either filled in immediately or left for pump_uploads() to stream in
+        void allocate_tile(int i, bool streamed)
+        {
+            auto & t = tiles[i];
+            
             checkerr(__LINE__);
             glActiveTexture(GL_TEXTURE0);
             
             checkerr(__LINE__);
             
-            glGenTextures(1, &texid);
-            glBindTexture(GL_TEXTURE_2D, texid);
-            printf("Actual size: %dx%d\n", this->w, this->h);
-            if(ismono)
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, this->w, this->h, 0, GL_RED, GL_UNSIGNED_BYTE, mydata);
+            glGenTextures(1, &t.texid);
+            glBindTexture(GL_TEXTURE_2D, t.texid);
+            
+            unsigned char * pixels = nullptr;
+            if(!streamed)
+            {
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+                pixels = mydata + (size_t(t.y)*w + t.x)*n;
+            }
+            if(n == 1)
+            {
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, t.w, t.h, 0, GL_RED, GL_UNSIGNED_BYTE, pixels);
+                // single channel pages read as opaque gray, so shaders don't need to know about them
+                GLint swizzle[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+                glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+            }
             else
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, this->w, this->h, 0, GL_RGBA, GL_UNSIGNED_BYTE, mydata);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, t.w, t.h, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
             
             checkerr(__LINE__);
-            puts("Generating mipmaps");
-            //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1);
-            glGenerateMipmap(GL_TEXTURE_2D);
-            puts("Done generating mipmaps");
+            if(streamed)
+            {
+                t.uploaded_rows = 0;
+                t.mip_levels = 0;
+                // mipmaps get generated once the last band arrives, until then only the base level is complete
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            }
+            else
+            {
+                t.uploaded_rows = t.h;
+                t.mip_levels = mip_count(t.w, t.h);
+                puts("Generating mipmaps");
+                //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1);
+                glGenerateMipmap(GL_TEXTURE_2D);
+                puts("Done generating mipmaps");
+            }
             checkerr(__LINE__);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            // tiles only see their own overlap, so wrapping around would pull in the wrong side of the tile
+            auto wrap = tiled ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
             checkerr(__LINE__);
         }
-        ~texture()
+        void release_tile(int i)
+        {
+            auto & t = tiles[i];
+            if(t.texid and glIsTexture(t.texid))
+                glDeleteTextures(1, &t.texid);
+            t.texid = 0;
+            t.uploaded_rows = 0;
+            t.mip_levels = 0;
+        }
+        static int mip_count(int w, int h)
+        {
+            int levels = 0;
+            for(int size = std::max(w, h); size > 1; size /= 2)
+                levels++;
+            return levels;
+        }
+        // the base level is all there, so the tile can be drawn, even if some of its mipmaps are still missing
+        bool tile_drawable(int i)
+        {
+            return tiles[i].texid != 0 and tiles[i].uploaded_rows >= tiles[i].h;
+        }
+        bool tile_complete(int i)
+        {
+            return tile_drawable(i) and tiles[i].mip_levels >= mip_count(tiles[i].w, tiles[i].h);
+        }
+        bool complete()
         {
-            stbi_image_free(mydata);
+            for(size_t i = 0; i < tiles.size(); i++)
+                if(!tile_complete(i)) return false;
+            return true;
         }
     };
+    
+    // ring of pixel unpack buffers that page data is streamed through, in bands of rows
+    // a band's fence must signal before its buffer gets written to again
+    static constexpr int pbo_count = 4;
+    static constexpr size_t pbo_size = 4*1024*1024;
+    GLuint pbos[pbo_count];
+    GLsync pbo_fences[pbo_count] = {};
+    int next_pbo = 0;
+    struct pendingupload {
+        texture * tex;
+        int tile;
+    };
+    std::deque<pendingupload> uploads;
+    int max_texture_size = 0;
+    
+    bool uploading()
+    {
+        return uploads.size() > 0;
+    }
+    void queue_tile(texture * tex, int i)
+    {
+        tex->allocate_tile(i, true);
+        uploads.push_back({tex, i});
+    }
+    void unqueue_tile(texture * tex, int i)
+    {
+        uploads.erase(std::remove_if(uploads.begin(), uploads.end(), [&](const pendingupload & u)
+        {
+            return u.tex == tex and (i < 0 or u.tile == i);
+        }), uploads.end());
+    }
+    // streams up to upload_bytes_per_frame of pending tile data, call once per frame
+    void pump_uploads()
+    {
+        size_t budget = std::max(double(upload_bytes_per_frame), 1.0);
+        while(uploads.size() > 0 and budget > 0)
+        {
+            auto tex = uploads.front().tex;
+            auto & t = tex->tiles[uploads.front().tile];
+            
+            if(t.uploaded_rows >= t.h)
+            {
+                // build the mip chain a level at a time from the level before it, instead of all at once in one frame
+                int levels = texture::mip_count(t.w, t.h);
+                if(t.mip_levels < levels)
+                {
+                    int level = t.mip_levels + 1;
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindTexture(GL_TEXTURE_2D, t.texid);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level-1);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level);
+                    glGenerateMipmap(GL_TEXTURE_2D);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+                    t.mip_levels = level;
+                    size_t bytes = size_t(std::max(1, t.w >> level))*std::max(1, t.h >> level)*tex->n;
+                    budget -= std::min(budget, bytes);
+                }
+                if(t.mip_levels >= levels)
+                {
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+                    uploads.pop_front();
+                    puts("Done streaming texture");
+                }
+                checkerr(__LINE__);
+                continue;
+            }
+            
+            int slot = next_pbo;
+            if(pbo_fences[slot])
+            {
+                // the GPU is still reading the band that went through this buffer; try again next frame
+                if(glClientWaitSync(pbo_fences[slot], 0, 0) == GL_TIMEOUT_EXPIRED)
+                    break;
+                glDeleteSync(pbo_fences[slot]);
+                pbo_fences[slot] = 0;
+            }
+            
+            size_t rowbytes = size_t(t.w)*tex->n;
+            int rows = std::min(std::min(pbo_size, budget)/rowbytes, size_t(t.h - t.uploaded_rows));
+            if(rows < 1) rows = 1;
+            size_t bytes = rows*rowbytes;
+            
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[slot]);
+            if(bytes > pbo_size) // absurdly wide single row
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+            auto dst = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            if(!dst)
+            {
+                puts("failed to map pixel unpack buffer");
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                break;
+            }
+            for(int row = 0; row < rows; row++)
+            {
+                size_t src = (size_t(t.y + t.uploaded_rows + row)*tex->w + t.x)*tex->n;
+                memcpy(dst + row*rowbytes, tex->mydata + src, rowbytes);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, t.texid);
+            if(tex->n == 1)
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, t.uploaded_rows, t.w, rows, GL_RED, GL_UNSIGNED_BYTE, (void *)0);
+            else
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, t.uploaded_rows, t.w, rows, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            
+            pbo_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            next_pbo = (slot+1)%pbo_count;
+            
+            t.uploaded_rows += rows;
+            budget -= std::min(budget, bytes);
+            checkerr(__LINE__);
+        }
+    }
     void delete_texture(texture * tex)
     {
-        if(glIsTexture(tex->texid))
-            glDeleteTextures(1, &tex->texid);
+        if(scaledpage_key.tex == tex)
+            scaledpage_key.tex = nullptr;
+        unqueue_tile(tex, -1);
+        for(size_t i = 0; i < tex->tiles.size(); i++)
+            tex->release_tile(i);
         delete tex;
     }
     texture * load_texture(const char * filename)
     {
-        auto start = glfwGetTime();
         puts("Starting load texture");
         puts(filename);
-        
         fflush(stdout);
-        int w, h, n;
         
-        auto f = wrap_fopen(filename, "rb");
-        unsigned char * data = stbi_load_from_file(f, &w, &h, &n, 4);
-        fclose(f);
-        puts("Done actual loading");
-        if(!data) return puts("failed to open texture"), nullptr;
+        return load_texture(decode_image(filename));
+    }
+    // upload a page that was already decoded (possibly by a pagedecoder thread)
+    texture * load_texture(decodedimage img)
+    {
+        auto start = glfwGetTime();
+        if(!img.data) return puts("failed to open texture"), nullptr;
         else
         {
-            printf("Building texture of size %dx%d\n", w, h);
+            printf("Building texture of size %dx%d\n", img.w, img.h);
             
-            auto tex = new texture(data, w, h);
+            // tiles overlap by enough for the downscaling kernel to not see a seam
+            int tilesize = std::min(int(tile_size), max_texture_size);
+            auto tex = new texture(img.data, img.w, img.h, img.n == 1, tilesize, 64);
+            tex->mymapping = img.mapping;
+            // tiled pages get their tiles uploaded by draw_texture as they come into view
+            if(!tex->tiled)
+                queue_tile(tex, 0);
             
             puts("Built texture");
             
@@ -263,43 +638,91 @@ struct renderer {
             return tex;
         }
     }
-    // load single-channel 8bpp texture
-    texture * load_texture(uint8_t * data, int w, int h)
+    
+    // glyph bitmaps are packed into a few shared single-channel textures, a shelf at a time,
+    // so that a whole line of text only needs one draw per atlas
+    static constexpr int atlas_size = 1024;
+    struct glyphatlas {
+        GLuint texid = 0;
+        int shelf_x = 0, shelf_y = 0, shelf_h = 0;
+    };
+    std::vector<glyphatlas> atlases;
+    struct atlasslot {
+        int page = -1;
+        float u1 = 0, v1 = 0, u2 = 0, v2 = 0;
+    };
+    struct textbatch {
+        int page, first, count;
+    };
+    void add_atlas()
+    {
+        glyphatlas atlas;
+        std::vector<uint8_t> blank(size_t(atlas_size)*atlas_size, 0);
+        
+        glActiveTexture(GL_TEXTURE0);
+        glGenTextures(1, &atlas.texid);
+        glBindTexture(GL_TEXTURE_2D, atlas.texid);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlas_size, atlas_size, 0, GL_RED, GL_UNSIGNED_BYTE, blank.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        checkerr(__LINE__);
+        
+        atlases.push_back(atlas);
+        printf("Started glyph atlas %d\n", int(atlases.size()));
+    }
+    // copies a single-channel bitmap into the atlas; returns false if it's too big to ever fit
+    bool atlas_add(const uint8_t * data, int w, int h, int pitch, atlasslot * slot)
     {
-        if(!data) return nullptr;
-        //auto start = glfwGetTime();
+        // one pixel of padding around every glyph, so that filtering never picks up its neighbors
+        int padded_w = w+2;
+        int padded_h = h+2;
+        if(padded_w > atlas_size or padded_h > atlas_size)
+            return false;
         
-        //printf("Building texture of size %dx%d from memory\n", w, h);
+        if(atlases.size() > 0 and atlases.back().shelf_x + padded_w > atlas_size)
+        {
+            auto & atlas = atlases.back();
+            atlas.shelf_y += atlas.shelf_h;
+            atlas.shelf_x = 0;
+            atlas.shelf_h = 0;
+        }
+        if(atlases.size() == 0 or atlases.back().shelf_y + padded_h > atlas_size)
+            add_atlas();
         
-        auto tex = new texture(data, w, h, true);
+        auto & atlas = atlases.back();
+        int x = atlas.shelf_x + 1;
+        int y = atlas.shelf_y + 1;
+        atlas.shelf_x += padded_w;
+        atlas.shelf_h = std::max(atlas.shelf_h, padded_h);
         
-        //puts("Built texture");
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, atlas.texid);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED, GL_UNSIGNED_BYTE, data);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        checkerr(__LINE__);
         
-        //auto end = glfwGetTime();
-        //printf("Time: %f\n", end-start);
-        return tex;
+        slot->page = atlases.size()-1;
+        slot->u1 = x/float(atlas_size);
+        slot->v1 = y/float(atlas_size);
+        slot->u2 = (x+w)/float(atlas_size);
+        slot->v2 = (y+h)/float(atlas_size);
+        return true;
     }
     
     
-    struct postprogram {
+    struct genericprogram {
         unsigned int program;
         unsigned int fshader;
         unsigned int vshader;
+        // every active uniform outside of a block, found once at link time
+        std::map<std::string, int> uniforms;
         
-        postprogram(const char * name, const char * fshadersource)
+        genericprogram(const char * name, const char * vshadersource, const char * fshadersource)
         {
-            const char * vshadersource =
-            "#version 330 core\n\
-            layout (location = 0) in vec3 aPos;\n\
-            layout (location = 1) in vec2 aTex;\n\
-            out vec2 myTexCoord;\n\
-            void main()\n\
-            {\n\
-                gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n\
-                myTexCoord = aTex;\n\
-            }\n"
-            ;
-            
             checkerr(__LINE__);
             vshader = glCreateShader(GL_VERTEX_SHADER);
             glShaderSource(vshader, 1, &vshadersource, NULL);
@@ -349,278 +772,124 @@ struct renderer {
             
             glDeleteShader(vshader);
             glDeleteShader(fshader);
-        }
-    };
-    
-    
-    struct genericprogram {
-        unsigned int program;
-        unsigned int fshader;
-        unsigned int vshader;
-        
-        genericprogram(const char * name, const char * vshadersource, const char * fshadersource)
-        {
-            checkerr(__LINE__);
-            vshader = glCreateShader(GL_VERTEX_SHADER);
-            glShaderSource(vshader, 1, &vshadersource, NULL);
-            glCompileShader(vshader);
-            checkerr(__LINE__);
-            
-            fshader = glCreateShader(GL_FRAGMENT_SHADER);
-            glShaderSource(fshader, 1, &fshadersource, NULL);
-            glCompileShader(fshader);
-            checkerr(__LINE__);
-            
-            program = glCreateProgram();
-            glAttachShader(program, vshader);
-            glAttachShader(program, fshader);
-            glLinkProgram(program);
-            checkerr(__LINE__);
             
-            int v,f,p;
-            glGetShaderiv(vshader, GL_COMPILE_STATUS, &v);
-            glGetShaderiv(fshader, GL_COMPILE_STATUS, &f);
-            glGetProgramiv(program, GL_LINK_STATUS, &p);
-            checkerr(__LINE__);
-            if(!v or !f or !p)
+            int count = 0;
+            glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+            for(int i = 0; i < count; i++)
             {
-                char info[512];
-                puts("Failed to compile shader:");
-                puts(name);
-                if(!v)
-                {
-                    glGetShaderInfoLog(vshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!f)
-                {
-                    glGetShaderInfoLog(fshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!p)
-                {
-                    glGetProgramInfoLog(program, 512, NULL, info);
-                    puts(info);
-                }
-                exit(0);
+                char uniformname[256];
+                int size;
+                unsigned int type;
+                glGetActiveUniform(program, i, sizeof(uniformname), NULL, &size, &type, uniformname);
+                int location = glGetUniformLocation(program, uniformname);
+                if(location >= 0)
+                    uniforms[uniformname] = location;
             }
             
+            // programs that draw with the camera share its matrices through a uniform buffer
+            auto block = glGetUniformBlockIndex(program, "camera");
+            if(block != GL_INVALID_INDEX)
+                glUniformBlockBinding(program, block, camera_binding);
             checkerr(__LINE__);
-            
-            glDeleteShader(vshader);
-            glDeleteShader(fshader);
+        }
+        // -1 (which GL ignores) if the uniform doesn't exist or was optimized out
+        int uniform(const std::string & name)
+        {
+            auto found = uniforms.find(name);
+            if(found == uniforms.end()) return -1;
+            return found->second;
         }
     };
     
-    struct rectprogram {
-        unsigned int program;
-        unsigned int fshader;
-        unsigned int vshader;
+    static constexpr unsigned int camera_binding = 0;
+    
+    // vertex shader for fullscreen passes over a framebuffer
+    static constexpr const char * post_vertex_source =
+    "#version 330 core\n\
+        layout (location = 0) in vec3 aPos;\n\
+        layout (location = 1) in vec2 aTex;\n\
+        out vec2 myTexCoord;\n\
+        void main()\n\
+        {\n\
+            gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n\
+            myTexCoord = aTex;\n\
+        }\n";
+    
+    unsigned int VAO, VBO, RectVAO, RectVBO, FBO, FBOtexture1, FBOtexture2, CameraUBO;
+    
+    // region overlays, only uploaded again when they change
+    unsigned int OutlineVAO, OutlineVBO;
+    size_t outline_count = 0, outline_capacity = 0;
+    int w, h;
+    
+    // the current page after filtering and sharpening at the current scale, so that panning only has to blit it
+    struct scaledpagekey {
+        texture * tex = nullptr;
+        float scale = 0;
+        int w = 0, h = 0;
+        float settings[11] = {};
+        bool operator==(const scaledpagekey & other) const
+        {
+            return tex == other.tex and scale == other.scale and w == other.w and h == other.h
+               and memcmp(settings, other.settings, sizeof(settings)) == 0;
+        }
+    };
+    scaledpagekey scaledpage_key;
+    unsigned int ScaledPageFBO, scaledpagetexture1, scaledpagetexture2, scaledpageresult = 0;
+    int scaledpage_w = 0, scaledpage_h = 0;
+    
+    // output of the horizontal sinc pass; only ever grows
+    unsigned int SincFBO, sincpasstexture;
+    int sincpass_w = 0, sincpass_h = 0;
+    
+    // normalized jinc weights for every quantized sub-pixel phase, for the current scale and radius
+    unsigned int weighttexture;
+    int weight_taps = 0;
+    float weight_scale = -1, weight_radius = -1;
+    
+    float jinctexture[512];
+    float sinctexture[512];
+    
+    bool downscaling = false;
+    float infoscale = 1.0;
+    
+    // uniform locations used while drawing, looked up once after the programs are linked
+    struct { int translation, myScale, usejinc, myradius, myWeightTaps, mySize, myVerticalPass, myColumnOffset, myRowOffset; } imageuniforms;
+    struct { int translation; } fastimageuniforms;
+    struct { int translation; } primitiveuniforms;
+    struct { int myCamera; } outlineuniforms;
+    struct { int translation; } textuniforms;
+    struct { int radius, blur, wetness; } sharpenuniforms;
+    struct { int frequency, radius1, radius2, blur1, blur2, hardness1, hardness2, wetness; } nusharpenuniforms;
+    struct { int myScale, myradius, myTexMap, myRowOffset; } sinchorizontaluniforms;
+    
+    GLFWwindow * win;
+    genericprogram * imageprogram, * fastimageprogram;
+    genericprogram * copy, * sharpen, * nusharpen, * sinchorizontal;
+    genericprogram * primitive, * outlineprogram;
+    genericprogram * mytextprogram;
+    renderer()
+    {
+        glfwSwapInterval(1);
+        
+        if(!glfwInit()) puts("glfw failed to init"), exit(0);
+        
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, 1); 
         
-        rectprogram(const char * name)
-        {
-            const char * vshadersource =
-            "#version 330 core\n\
-            uniform mat4 projection;\n\
-            uniform mat4 translation;\n\
-            layout (location = 0) in vec3 aPos;\n\
-            layout (location = 1) in vec4 aCol;\n\
-            out vec4 vCol;\n\
-            void main()\n\
-            {\n\
-                gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0) * translation * projection;\n\
-                vCol = aCol;\n\
-            }\n"
-            ;
-            
-            const char * fshadersource =
-            "#version 330 core\n\
-            in vec4 vCol;\n\
-            layout(location = 0) out vec4 fragColor;\n\
-            void main()\n\
-            {\n\
-                fragColor = vCol;\n\
-            }\n"
-            ;
-            
-            checkerr(__LINE__);
-            vshader = glCreateShader(GL_VERTEX_SHADER);
-            glShaderSource(vshader, 1, &vshadersource, NULL);
-            glCompileShader(vshader);
-            checkerr(__LINE__);
-            
-            fshader = glCreateShader(GL_FRAGMENT_SHADER);
-            glShaderSource(fshader, 1, &fshadersource, NULL);
-            glCompileShader(fshader);
-            checkerr(__LINE__);
-            
-            program = glCreateProgram();
-            glAttachShader(program, vshader);
-            glAttachShader(program, fshader);
-            glLinkProgram(program);
-            checkerr(__LINE__);
-            
-            int v,f,p;
-            glGetShaderiv(vshader, GL_COMPILE_STATUS, &v);
-            glGetShaderiv(fshader, GL_COMPILE_STATUS, &f);
-            glGetProgramiv(program, GL_LINK_STATUS, &p);
-            checkerr(__LINE__);
-            if(!v or !f or !p)
-            {
-                char info[512];
-                puts("Failed to compile shader:");
-                puts(name);
-                if(!v)
-                {
-                    glGetShaderInfoLog(vshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!f)
-                {
-                    glGetShaderInfoLog(fshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!p)
-                {
-                    glGetProgramInfoLog(program, 512, NULL, info);
-                    puts(info);
-                }
-                exit(0);
-            }
-            
-            checkerr(__LINE__);
-            
-            glDeleteShader(vshader);
-            glDeleteShader(fshader);
-        }
-    };
-    
-    struct textprogram {
-        unsigned int program;
-        unsigned int fshader;
-        unsigned int vshader;
-        
-        textprogram(const char * name)
-        {
-            const char * vshadersource =
-            "#version 330 core\n\
-            uniform mat4 projection;\n\
-            uniform mat4 translation;\n\
-            layout (location = 0) in vec3 aPos;\n\
-            layout (location = 1) in vec2 aCoord;\n\
-            out vec4 vCol;\n\
-            out vec2 texCoord;\n\
-            void main()\n\
-            {\n\
-                gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0) * translation * projection;\n\
-                texCoord = aCoord;\n\
-            }\n"
-            ;
-            
-            const char * fshadersource =
-            "#version 330 core\n\
-            uniform sampler2D mytexture;\n\
-            in vec2 texCoord;\n\
-            layout(location = 0) out vec4 fragColor;\n\
-            void main()\n\
-            {\n\
-                fragColor = vec4(1,1,1,texture2D(mytexture, texCoord));\n\
-            }\n"
-            ;
-            
-            checkerr(__LINE__);
-            vshader = glCreateShader(GL_VERTEX_SHADER);
-            glShaderSource(vshader, 1, &vshadersource, NULL);
-            glCompileShader(vshader);
-            checkerr(__LINE__);
-            
-            fshader = glCreateShader(GL_FRAGMENT_SHADER);
-            glShaderSource(fshader, 1, &fshadersource, NULL);
-            glCompileShader(fshader);
-            checkerr(__LINE__);
-            
-            program = glCreateProgram();
-            glAttachShader(program, vshader);
-            glAttachShader(program, fshader);
-            glLinkProgram(program);
-            checkerr(__LINE__);
-            
-            int v,f,p;
-            glGetShaderiv(vshader, GL_COMPILE_STATUS, &v);
-            glGetShaderiv(fshader, GL_COMPILE_STATUS, &f);
-            glGetProgramiv(program, GL_LINK_STATUS, &p);
-            checkerr(__LINE__);
-            if(!v or !f or !p)
-            {
-                char info[512];
-                puts("Failed to compile shader:");
-                puts(name);
-                if(!v)
-                {
-                    glGetShaderInfoLog(vshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!f)
-                {
-                    glGetShaderInfoLog(fshader, 512, NULL, info);
-                    puts(info);
-                }
-                if(!p)
-                {
-                    glGetProgramInfoLog(program, 512, NULL, info);
-                    puts(info);
-                }
-                exit(0);
-            }
-            
-            checkerr(__LINE__);
-            
-            glDeleteShader(vshader);
-            glDeleteShader(fshader);
-        }
-    };
-    
-    unsigned int VAO, VBO, RectVAO, RectVBO, FBO, FBOtexture1, FBOtexture2;
-    int w, h;
-    
-    float jinctexture[512];
-    float sinctexture[512];
-    
-    bool downscaling = false;
-    float infoscale = 1.0;
-    
-    GLFWwindow * win;
-    genericprogram * imageprogram, * fastimageprogram;
-    postprogram * copy, * sharpen, * nusharpen;
-    rectprogram * primitive;
-    textprogram * mytextprogram;
-    renderer()
-    {
-        glfwSwapInterval(1);
-        
-        if(!glfwInit()) puts("glfw failed to init"), exit(0);
-        
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-        glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, 1); 
-        
-        win = glfwCreateWindow(1104*0.8, 600, "ネズヨミ nezuyomi, an image viewer", NULL, NULL);
-        
-        if(!win) puts("glfw failed to init"), exit(0);
-        glfwMakeContextCurrent(win);
-        
-        if(gl3wInit()) puts("gl3w failed to init"), exit(0);
-        
-        for(int i = 0; i < 512; i++)
+        win = glfwCreateWindow(1104*0.8, 600, "ネズヨミ nezuyomi, an image viewer", NULL, NULL);
+        
+        if(!win) puts("glfw failed to init"), exit(0);
+        glfwMakeContextCurrent(win);
+        
+        if(gl3wInit()) puts("gl3w failed to init"), exit(0);
+        
+        for(int i = 0; i < 512; i++)
         {
             //jinctexture[i] = sin(float(i)*M_PI/4)*0.5+0.5;///(float(i)*M_PI/4)*0.5+0.5;
-            if(i == 0) jinctexture[i] = 1.0;
-            #ifdef _WIN32
-            else       jinctexture[i] = 2*std::cyl_bessel_j(1, float(i*M_PI)/8)/(float(i*M_PI)/8)*0.5+0.5;
-            #else
-            else       jinctexture[i] = 2*j1(float(i*M_PI)/8)/(float(i*M_PI)/8)*0.5+0.5;
-            #endif
+            jinctexture[i] = jinc(i/8.0)*0.5+0.5;
             
             if(i == 0) sinctexture[i] = 1.0;
             else       sinctexture[i] = sin(float(i*M_PI)/8)/(float(i*M_PI)/8)*0.5+0.5;
@@ -642,6 +911,21 @@ struct renderer {
         glDepthFunc(GL_LEQUAL);
         glPixelStorei(GL_PACK_ALIGNMENT, 1);
         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+        
+        glGenBuffers(pbo_count, pbos);
+        for(int i = 0; i < pbo_count; i++)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, pbo_size, NULL, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        
+        glGenBuffers(1, &CameraUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, CameraUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(float)*16, NULL, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, camera_binding, CameraUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
         
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
@@ -671,12 +955,30 @@ struct renderer {
         glEnableVertexAttribArray(1);
         
         
+        glGenVertexArrays(1, &OutlineVAO);
+        glGenBuffers(1, &OutlineVBO);
+        
+        glBindVertexArray(OutlineVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, OutlineVBO);
+        // everything is per-instance; the vertex shader picks the corner from gl_VertexID
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(outlineinstance), (void*)offsetof(outlineinstance, corners));
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(outlineinstance), (void*)(offsetof(outlineinstance, corners)+sizeof(float)*4));
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(outlineinstance), (void*)offsetof(outlineinstance, offsets));
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(outlineinstance), (void*)offsetof(outlineinstance, r));
+        glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(outlineinstance), (void*)offsetof(outlineinstance, clip));
+        for(int i = 0; i < 5; i++)
+        {
+            glVertexAttribDivisor(i, 1);
+            glEnableVertexAttribArray(i);
+        }
+        
+        
         checkerr(__LINE__);
         
         fastimageprogram = new genericprogram("fastimageprogram", 
         
         "#version 330 core\n\
-        uniform mat4 projection;\n\
+        layout(std140) uniform camera { mat4 projection; };\n\
         uniform mat4 translation;\n\
         layout (location = 0) in vec3 aPos;\n\
         layout (location = 1) in vec2 aTex;\n\
@@ -697,14 +999,14 @@ struct renderer {
         }\n");
         
         glUseProgram(fastimageprogram->program);
-        glUniform1i(glGetUniformLocation(fastimageprogram->program, "mytexture"), 0);
+        glUniform1i(fastimageprogram->uniform("mytexture"), 0);
         
         checkerr(__LINE__);
         
         imageprogram = new genericprogram("imageprogram", 
         
         "#version 330 core\n\
-        uniform mat4 projection;\n\
+        layout(std140) uniform camera { mat4 projection; };\n\
         uniform mat4 translation;\n\
         layout (location = 0) in vec3 aPos;\n\
         layout (location = 1) in vec2 aTex;\n\
@@ -723,6 +1025,12 @@ struct renderer {
         uniform vec2 myScale;\n\
         uniform int usejinc;\n\
         uniform float myradius;\n\
+        uniform sampler2D myIntermediate;\n\
+        uniform int myVerticalPass;\n\
+        uniform int myColumnOffset;\n\
+        uniform int myRowOffset;\n\
+        uniform sampler2D myWeights;\n\
+        uniform int myWeightTaps;\n\
         in vec2 myTexCoord;\n\
         #define M_PI 3.1415926435\n\
         //int lod;\n\
@@ -798,6 +1106,33 @@ struct renderer {
             if(x < -radius || x > radius) return 0.0;\n\
             return sinc(x) * cos(x*M_PI/2/radius);\n\
         }\n\
+        // jinc with precomputed, normalized weights: one row of myWeights per sub-pixel phase, quantized to 16ths\n\
+        vec4 weightedgrid()\n\
+        {\n\
+            int lod = 0;\n\
+            if(myScale.x > 0 && myScale.x < 0.25)\n\
+                lod += 1;\n\
+            ivec2 size = textureSize(mytexture, lod);\n\
+            vec2 pos = myTexCoord*size - 0.5;\n\
+            vec2 base = floor(pos);\n\
+            ivec2 q = ivec2(floor((pos-base)*16 + 0.5));\n\
+            if(q.x == 16) { q.x = 0; base.x += 1; }\n\
+            if(q.y == 16) { q.y = 0; base.y += 1; }\n\
+            int taps = myWeightTaps;\n\
+            int first = 1 - taps/2;\n\
+            int phase = q.y*16 + q.x;\n\
+            vec4 c = vec4(0);\n\
+            for(int j = 0; j < taps; j++)\n\
+            {\n\
+                for(int i = 0; i < taps; i++)\n\
+                {\n\
+                    float weight = texelFetch(myWeights, ivec2(j*taps + i, phase), 0).r;\n\
+                    if(weight == 0.0) continue;\n\
+                    c += textureLod(mytexture, (base + vec2(first+i, first+j) + 0.5)/size, lod)*weight;\n\
+                }\n\
+            }\n\
+            return c;\n\
+        }\n\
         bool supersamplemode;\n\
         vec4 supersamplegrid()\n\
         {\n\
@@ -841,13 +1176,52 @@ struct renderer {
             c /= sampleWeight;\n\
             return c;\n\
         }\n\
+        // second half of separable sinc: columns were already filtered into myIntermediate, one row per source row\n\
+        vec4 sincvertical()\n\
+        {\n\
+            int lod = 0;\n\
+            float radius;\n\
+            radius = myradius;\n\
+            vec2 scale = myScale;\n\
+            if(scale.x > 0 && scale.x < 0.25)\n\
+            {\n\
+                radius /= 2;\n\
+                scale *= 2;\n\
+                lod += 1;\n\
+            }\n\
+            if(radius < 1) radius = 1;\n\
+            ivec2 size = textureSize(mytexture, lod);\n\
+            int rows = textureSize(myIntermediate, 0).y;\n\
+            float iy = mod(myTexCoord.y*(size.y)+0.5, 1);\n\
+            int base = int(floor(myTexCoord.y*(size.y)-0.5));\n\
+            int column = int(gl_FragCoord.x) - myColumnOffset;\n\
+            int lowj  = int(floor(-radius/scale.y + iy));\n\
+            int highj = int(ceil(radius/scale.y + iy));\n\
+            vec4 c = vec4(0);\n\
+            float sampleWeight = 0;\n\
+            for(int j = lowj; j <= highj; j++)\n\
+            {\n\
+                float weight = sincwindow((j-iy)*scale.y, radius);\n\
+                int row = clamp(base + j - myRowOffset, 0, rows-1);\n\
+                sampleWeight += weight;\n\
+                c += texelFetch(myIntermediate, ivec2(column, row), 0)*weight;\n\
+            }\n\
+            return c/sampleWeight;\n\
+        }\n\
         layout(location = 0) out vec4 fragColor;\n\
         void main()\n\
         {\n\
-            if(myScale.x < 1 || myScale.y < 1)\n\
+            if(myVerticalPass != 0)\n\
+            {\n\
+                fragColor = sincvertical();\n\
+            }\n\
+            else if(myScale.x < 1 || myScale.y < 1)\n\
             {\n\
                 supersamplemode = (usejinc != 0);\n\
-                fragColor =  supersamplegrid();\n\
+                if(supersamplemode && myWeightTaps > 0)\n\
+                    fragColor = weightedgrid();\n\
+                else\n\
+                    fragColor =  supersamplegrid();\n\
             }\n\
             else if(myScale.x == 1 && myScale.y == 1)\n\
             {\n\
@@ -863,87 +1237,227 @@ struct renderer {
         checkerr(__LINE__);
         
         glUseProgram(imageprogram->program);
-        glUniform1i(glGetUniformLocation(imageprogram->program, "mytexture"), 0);
-        glUniform1i(glGetUniformLocation(imageprogram->program, "myJincLookup"), 1);
-        glUniform1i(glGetUniformLocation(imageprogram->program, "mySincLookup"), 2);
-        
-        checkerr(__LINE__);
-        
-        // other drawing program
-        
-        primitive = new rectprogram("primitive");
-        
-        // other drawing program
+        glUniform1i(imageprogram->uniform("mytexture"), 0);
+        glUniform1i(imageprogram->uniform("myJincLookup"), 1);
+        glUniform1i(imageprogram->uniform("mySincLookup"), 2);
+        glUniform1i(imageprogram->uniform("myIntermediate"), 3);
+        glUniform1i(imageprogram->uniform("myWeights"), 4);
         
-        mytextprogram = new textprogram("textprogram");
-        
-        // FBO programs
-        
-        copy = new postprogram("copy", 
-        "#version 330 core\n\
-        uniform sampler2D mytexture;\n\
-        in vec2 myTexCoord;\n\
-        layout(location = 0) out vec4 fragColor;\n\
-        void main()\n\
-        {\n\
-            fragColor = texture2D(mytexture, myTexCoord);\n\
-        }\n");
-        
-        glUseProgram(copy->program);
-        checkerr(__LINE__);
-        glUniform1i(glGetUniformLocation(copy->program, "mytexture"), 0);
         checkerr(__LINE__);
         
-        sharpen = new postprogram("sharpen", 
+        // first half of separable sinc: filters along x only, into one row per source row
+        // myTexMap maps the output column to the source texture's x coordinate, myRowOffset the output row to the source row
+        sinchorizontal = new genericprogram("sinchorizontal", post_vertex_source,
         "#version 330 core\n\
         uniform sampler2D mytexture;\n\
-        uniform sampler2D myJincLookup;\n\
-        uniform float radius;\n\
-        uniform float blur;\n\
-        uniform float wetness;\n\
-        in vec2 myTexCoord;\n\
+        uniform sampler2D mySincLookup;\n\
+        uniform float myScale;\n\
+        uniform float myradius;\n\
+        uniform vec2 myTexMap;\n\
+        uniform int myRowOffset;\n\
         #define M_PI 3.1415926435\n\
-        float jinc(float x)\n\
+        float sinc(float x)\n\
         {\n\
-            return texture2D(myJincLookup, vec2(x*8/512, 0)).r*2-1;\n\
+            return texture2D(mySincLookup, vec2(x*8/512, 0)).r*2-1;\n\
         }\n\
-        float jincwindow(float x, float radius)\n\
+        float sincwindow(float x, float radius)\n\
         {\n\
             if(x < -radius || x > radius) return 0.0;\n\
-            return jinc(x) * cos(x*M_PI/2/radius);\n\
+            return sinc(x) * cos(x*M_PI/2/radius);\n\
         }\n\
         layout(location = 0) out vec4 fragColor;\n\
         void main()\n\
         {\n\
-            ivec2 size = textureSize(mytexture, 0);\n\
-            vec2 texel = myTexCoord*size;\n\
-            vec4 color = vec4(0);\n\
-            float power = 0;\n\
-            for(int i = -int(floor(radius)); i <= int(ceil(radius)); i++)\n\
+            int lod = 0;\n\
+            float radius;\n\
+            radius = myradius;\n\
+            float scale = myScale;\n\
+            if(scale > 0 && scale < 0.25)\n\
             {\n\
-                for(int j = -int(floor(radius)); j <= int(ceil(radius)); j++)\n\
-                {\n\
-                    float weight = jincwindow(sqrt(i*i+j*j)/blur, radius*blur);\n\
-                    power += weight;\n\
-                    color += texture2D(mytexture, vec2(texel.x + i, texel.y + j)/size)*weight;\n\
-                }\n\
+                radius /= 2;\n\
+                scale *= 2;\n\
+                lod += 1;\n\
             }\n\
-            vec4 delta = texture2D(mytexture, myTexCoord)-color/power;\n\
-            fragColor = texture2D(mytexture, myTexCoord) + wetness*delta;\n\
+            if(radius < 1) radius = 1;\n\
+            ivec2 size = textureSize(mytexture, lod);\n\
+            float x = myTexMap.x*gl_FragCoord.x + myTexMap.y;\n\
+            float v = (floor(gl_FragCoord.y) + myRowOffset + 0.5)/size.y;\n\
+            float ix = mod(x*(size.x)+0.5, 1);\n\
+            float base = floor(x*(size.x)-0.5);\n\
+            int lowi  = int(floor(-radius/scale + ix));\n\
+            int highi = int(ceil(radius/scale + ix));\n\
+            vec4 c = vec4(0);\n\
+            float sampleWeight = 0;\n\
+            for(int i = lowi; i <= highi; i++)\n\
+            {\n\
+                float weight = sincwindow((i-ix)*scale, radius);\n\
+                sampleWeight += weight;\n\
+                c += textureLod(mytexture, vec2((base+i+0.5)/size.x, v), lod)*weight;\n\
+            }\n\
+            fragColor = c/sampleWeight;\n\
         }\n");
         
-        glUseProgram(sharpen->program);
-        checkerr(__LINE__);
-        glUniform1i(glGetUniformLocation(sharpen->program, "mytexture"), 0);
-        checkerr(__LINE__);
-        glUniform1i(glGetUniformLocation(sharpen->program, "myJincLookup"), 1);
+        glUseProgram(sinchorizontal->program);
+        glUniform1i(sinchorizontal->uniform("mytexture"), 0);
+        glUniform1i(sinchorizontal->uniform("mySincLookup"), 2);
+        
         checkerr(__LINE__);
         
-        nusharpen = new postprogram("nusharpen", 
+        // other drawing program
+        
+        primitive = new genericprogram("primitive", 
         "#version 330 core\n\
-        uniform sampler2D mytexture;\n\
-        uniform sampler2D myJincLookup;\n\
-        uniform float radius1;\n\
+        layout(std140) uniform camera { mat4 projection; };\n\
+        uniform mat4 translation;\n\
+        layout (location = 0) in vec3 aPos;\n\
+        layout (location = 1) in vec4 aCol;\n\
+        out vec4 vCol;\n\
+        void main()\n\
+        {\n\
+            gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0) * translation * projection;\n\
+            vCol = aCol;\n\
+        }\n",
+        
+        "#version 330 core\n\
+        in vec4 vCol;\n\
+        layout(location = 0) out vec4 fragColor;\n\
+        void main()\n\
+        {\n\
+            fragColor = vCol;\n\
+        }\n");
+        
+        // other drawing program
+        
+        outlineprogram = new genericprogram("outlineprogram", 
+        "#version 330 core\n\
+        layout(std140) uniform camera { mat4 projection; };\n\
+        uniform vec3 myCamera;\n\
+        layout (location = 0) in vec4 aTop;\n\
+        layout (location = 1) in vec4 aBottom;\n\
+        layout (location = 2) in vec4 aOffsets;\n\
+        layout (location = 3) in vec4 aCol;\n\
+        layout (location = 4) in vec4 aClip;\n\
+        out vec4 vCol;\n\
+        out vec2 vPos;\n\
+        flat out vec4 vClip;\n\
+        void main()\n\
+        {\n\
+            vec2 corner;\n\
+            if(gl_VertexID == 0) corner = aTop.xy;\n\
+            else if(gl_VertexID == 1) corner = aTop.zw;\n\
+            else if(gl_VertexID == 2) corner = aBottom.xy;\n\
+            else corner = aBottom.zw;\n\
+            vec2 offset = vec2((gl_VertexID & 1) != 0 ? aOffsets.y : aOffsets.x, (gl_VertexID & 2) != 0 ? aOffsets.w : aOffsets.z);\n\
+            vPos = corner*myCamera.z - myCamera.xy + offset;\n\
+            gl_Position = vec4(vPos.x, vPos.y, 0.0, 1.0) * projection;\n\
+            vCol = aCol;\n\
+            vClip = aClip*myCamera.z - myCamera.xyxy;\n\
+        }\n",
+        
+        "#version 330 core\n\
+        in vec4 vCol;\n\
+        in vec2 vPos;\n\
+        flat in vec4 vClip;\n\
+        layout(location = 0) out vec4 fragColor;\n\
+        void main()\n\
+        {\n\
+            if(vPos.x < vClip.x || vPos.x > vClip.z || vPos.y < vClip.y || vPos.y > vClip.w)\n\
+                discard;\n\
+            fragColor = vCol;\n\
+        }\n");
+        
+        // other drawing program
+        
+        mytextprogram = new genericprogram("textprogram", 
+        "#version 330 core\n\
+        layout(std140) uniform camera { mat4 projection; };\n\
+        uniform mat4 translation;\n\
+        layout (location = 0) in vec3 aPos;\n\
+        layout (location = 1) in vec2 aCoord;\n\
+        out vec4 vCol;\n\
+        out vec2 texCoord;\n\
+        void main()\n\
+        {\n\
+            gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0) * translation * projection;\n\
+            texCoord = aCoord;\n\
+        }\n",
+        
+        "#version 330 core\n\
+        uniform sampler2D mytexture;\n\
+        in vec2 texCoord;\n\
+        layout(location = 0) out vec4 fragColor;\n\
+        void main()\n\
+        {\n\
+            fragColor = vec4(1,1,1,texture2D(mytexture, texCoord));\n\
+        }\n");
+        
+        // FBO programs
+        
+        copy = new genericprogram("copy", post_vertex_source,
+        "#version 330 core\n\
+        uniform sampler2D mytexture;\n\
+        in vec2 myTexCoord;\n\
+        layout(location = 0) out vec4 fragColor;\n\
+        void main()\n\
+        {\n\
+            fragColor = texture2D(mytexture, myTexCoord);\n\
+        }\n");
+        
+        glUseProgram(copy->program);
+        checkerr(__LINE__);
+        glUniform1i(copy->uniform("mytexture"), 0);
+        checkerr(__LINE__);
+        
+        sharpen = new genericprogram("sharpen", post_vertex_source,
+        "#version 330 core\n\
+        uniform sampler2D mytexture;\n\
+        uniform sampler2D myJincLookup;\n\
+        uniform float radius;\n\
+        uniform float blur;\n\
+        uniform float wetness;\n\
+        in vec2 myTexCoord;\n\
+        #define M_PI 3.1415926435\n\
+        float jinc(float x)\n\
+        {\n\
+            return texture2D(myJincLookup, vec2(x*8/512, 0)).r*2-1;\n\
+        }\n\
+        float jincwindow(float x, float radius)\n\
+        {\n\
+            if(x < -radius || x > radius) return 0.0;\n\
+            return jinc(x) * cos(x*M_PI/2/radius);\n\
+        }\n\
+        layout(location = 0) out vec4 fragColor;\n\
+        void main()\n\
+        {\n\
+            ivec2 size = textureSize(mytexture, 0);\n\
+            vec2 texel = myTexCoord*size;\n\
+            vec4 color = vec4(0);\n\
+            float power = 0;\n\
+            for(int i = -int(floor(radius)); i <= int(ceil(radius)); i++)\n\
+            {\n\
+                for(int j = -int(floor(radius)); j <= int(ceil(radius)); j++)\n\
+                {\n\
+                    float weight = jincwindow(sqrt(i*i+j*j)/blur, radius*blur);\n\
+                    power += weight;\n\
+                    color += texture2D(mytexture, vec2(texel.x + i, texel.y + j)/size)*weight;\n\
+                }\n\
+            }\n\
+            vec4 delta = texture2D(mytexture, myTexCoord)-color/power;\n\
+            fragColor = texture2D(mytexture, myTexCoord) + wetness*delta;\n\
+        }\n");
+        
+        glUseProgram(sharpen->program);
+        checkerr(__LINE__);
+        glUniform1i(sharpen->uniform("mytexture"), 0);
+        checkerr(__LINE__);
+        glUniform1i(sharpen->uniform("myJincLookup"), 1);
+        checkerr(__LINE__);
+        
+        nusharpen = new genericprogram("nusharpen", post_vertex_source,
+        "#version 330 core\n\
+        uniform sampler2D mytexture;\n\
+        uniform sampler2D myJincLookup;\n\
+        uniform float radius1;\n\
         uniform float radius2;\n\
         uniform float blur1;\n\
         uniform float blur2;\n\
@@ -1011,10 +1525,40 @@ struct renderer {
         
         glUseProgram(nusharpen->program);
         checkerr(__LINE__);
-        glUniform1i(glGetUniformLocation(nusharpen->program, "mytexture"), 0);
-        glUniform1i(glGetUniformLocation(nusharpen->program, "myJincLookup"), 1);
+        glUniform1i(nusharpen->uniform("mytexture"), 0);
+        glUniform1i(nusharpen->uniform("myJincLookup"), 1);
         checkerr(__LINE__);
         
+        // look up everything drawing needs now, instead of by name on every draw
+        imageuniforms.translation = imageprogram->uniform("translation");
+        imageuniforms.myScale = imageprogram->uniform("myScale");
+        imageuniforms.usejinc = imageprogram->uniform("usejinc");
+        imageuniforms.myradius = imageprogram->uniform("myradius");
+        imageuniforms.myWeightTaps = imageprogram->uniform("myWeightTaps");
+        imageuniforms.mySize = imageprogram->uniform("mySize");
+        imageuniforms.myVerticalPass = imageprogram->uniform("myVerticalPass");
+        imageuniforms.myColumnOffset = imageprogram->uniform("myColumnOffset");
+        imageuniforms.myRowOffset = imageprogram->uniform("myRowOffset");
+        fastimageuniforms.translation = fastimageprogram->uniform("translation");
+        primitiveuniforms.translation = primitive->uniform("translation");
+        outlineuniforms.myCamera = outlineprogram->uniform("myCamera");
+        textuniforms.translation = mytextprogram->uniform("translation");
+        sharpenuniforms.radius = sharpen->uniform("radius");
+        sharpenuniforms.blur = sharpen->uniform("blur");
+        sharpenuniforms.wetness = sharpen->uniform("wetness");
+        nusharpenuniforms.frequency = nusharpen->uniform("frequency");
+        nusharpenuniforms.radius1 = nusharpen->uniform("radius1");
+        nusharpenuniforms.radius2 = nusharpen->uniform("radius2");
+        nusharpenuniforms.blur1 = nusharpen->uniform("blur1");
+        nusharpenuniforms.blur2 = nusharpen->uniform("blur2");
+        nusharpenuniforms.hardness1 = nusharpen->uniform("hardness1");
+        nusharpenuniforms.hardness2 = nusharpen->uniform("hardness2");
+        nusharpenuniforms.wetness = nusharpen->uniform("wetness");
+        sinchorizontaluniforms.myScale = sinchorizontal->uniform("myScale");
+        sinchorizontaluniforms.myradius = sinchorizontal->uniform("myradius");
+        sinchorizontaluniforms.myTexMap = sinchorizontal->uniform("myTexMap");
+        sinchorizontaluniforms.myRowOffset = sinchorizontal->uniform("myRowOffset");
+        
         // make framebuffer
         
         glGenFramebuffers(1, &FBO); 
@@ -1044,6 +1588,15 @@ struct renderer {
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, FBOtexture2, 0);
         checkerr(__LINE__);
         
+        // textures get allocated once a page is drawn through it
+        glGenFramebuffers(1, &ScaledPageFBO);
+        glGenTextures(1, &scaledpagetexture1);
+        glGenTextures(1, &scaledpagetexture2);
+        glGenFramebuffers(1, &SincFBO);
+        glGenTextures(1, &sincpasstexture);
+        glGenTextures(1, &weighttexture);
+        checkerr(__LINE__);
+        
         // non-framebuffer texture
         
         unsigned int jinctexid;
@@ -1069,9 +1622,22 @@ struct renderer {
         checkerr(__LINE__);
     }
     
-    void cycle_start()
+    // projection for every program that draws with the camera, mapping pixels in a width by height target to clip space
+    void set_projection(int width, int height)
+    {
+        float projection[16] = {
+            2.0f/width,  0.0f, 0.0f,-1.0f,
+            0.0f, -2.0f/height, 0.0f, 1.0f,
+            0.0f,    0.0f, 1.0f, 0.0f,
+            0.0f,    0.0f, 0.0f, 1.0f
+        };
+        glBindBuffer(GL_UNIFORM_BUFFER, CameraUBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(projection), projection);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    // follows the window's framebuffer size; called at the start of every frame, and before that by anything that needs the new size early
+    void update_size()
     {
-        checkerr(__LINE__);
         int w2, h2;
         glfwGetFramebufferSize(win, &w2, &h2);
         
@@ -1112,94 +1678,62 @@ struct renderer {
             glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, FBOtexture2, 0);
             checkerr(__LINE__);
         }
+    }
+    void cycle_start()
+    {
+        checkerr(__LINE__);
+        pump_uploads();
+        update_size();
         
-        
-        float projection[16] = {
-            2.0f/w,  0.0f, 0.0f,-1.0f,
-            0.0f, -2.0f/h, 0.0f, 1.0f,
-            0.0f,    0.0f, 1.0f, 0.0f,
-            0.0f,    0.0f, 0.0f, 1.0f
-        };
+        set_projection(w, h);
         
         if(fastgl)
         {
             glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
             glDrawBuffer(GL_BACK);
-            glUseProgram(fastimageprogram->program);
-            glUniformMatrix4fv(glGetUniformLocation(fastimageprogram->program, "projection"), 1, 0, projection);
         }
         else
         {
             glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
             glDrawBuffer(GL_COLOR_ATTACHMENT0);
-            glUseProgram(imageprogram->program);
-            glUniformMatrix4fv(glGetUniformLocation(imageprogram->program, "projection"), 1, 0, projection);
         }
         glEnable(GL_DEPTH_TEST);
         glEnable(GL_BLEND);
         
-        
-        glUseProgram(primitive->program);
-        glUniformMatrix4fv(glGetUniformLocation(primitive->program, "projection"), 1, 0, projection);
-        
-        glUseProgram(mytextprogram->program);
-        glUniformMatrix4fv(glGetUniformLocation(mytextprogram->program, "projection"), 1, 0, projection);
-        
         glClearColor(0,0,0,1);
         glDepthMask(true);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
         checkerr(__LINE__);
     }
-    void cycle_post()
+    // runs the enabled sharpening passes over whatever was drawn to attachment 0 of fbo, ping-ponging between its two attachments
+    // expects the fullscreen quad to be in VBO; returns the texture holding the result
+    unsigned int post_passes(unsigned int fbo, unsigned int tex1, unsigned int tex2)
     {
-        if(fastgl) return;
-        
-        checkerr(__LINE__);
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        
-        glDisable(GL_DEPTH_TEST);
-        glDisable(GL_BLEND);
-        
-        const vertex vertices[] = {
-            {-1.f, -1.f, 0.5f, 0.0f, 0.0f},
-            { 1.f, -1.f, 0.5f, 1.0f, 0.0f},
-            {-1.f,  1.f, 0.5f, 0.0f, 1.0f},
-            { 1.f,  1.f, 0.5f, 1.0f, 1.0f}
-        };
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
-        checkerr(__LINE__);
-        
         int currtex = 0;
         
         auto BUFFER_A = [&]()
         {
-            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
             glDrawBuffer(GL_COLOR_ATTACHMENT1);
         };
         auto BUFFER_B = [&]()
         {
-            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
             glDrawBuffer(GL_COLOR_ATTACHMENT0);
         };
-        auto BUFFER_DONE = [&]()
-        {
-            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-            glDrawBuffer(GL_BACK);
-        };
         
         auto FLIP_SOURCE = [&]()
         {
             if(currtex == 1)
             {
-                glBindTexture(GL_TEXTURE_2D, FBOtexture2);
+                glBindTexture(GL_TEXTURE_2D, tex2);
                 currtex = 2;
                 BUFFER_B();
             }
             else
             {
-                glBindTexture(GL_TEXTURE_2D, FBOtexture1);
+                glBindTexture(GL_TEXTURE_2D, tex1);
                 currtex = 1;
                 BUFFER_A();
             }
@@ -1210,9 +1744,9 @@ struct renderer {
         {
             FLIP_SOURCE();
             glUseProgram(sharpen->program);
-            glUniform1f(glGetUniformLocation(sharpen->program, "radius"), downscaleradius);
-            glUniform1f(glGetUniformLocation(sharpen->program, "blur"), 1.0f);
-            glUniform1f(glGetUniformLocation(sharpen->program, "wetness"), 1.0f);
+            glUniform1f(sharpenuniforms.radius, downscaleradius);
+            glUniform1f(sharpenuniforms.blur, 1.0f);
+            glUniform1f(sharpenuniforms.wetness, 1.0f);
             glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         }
         checkerr(__LINE__);
@@ -1221,20 +1755,51 @@ struct renderer {
         {
             FLIP_SOURCE();
             glUseProgram(nusharpen->program);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "frequency"), infoscale);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "radius1"), sharpradius1);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "radius2"), sharpradius2);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "blur1"), sharpblur1);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "blur2"), sharpblur2);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "hardness1"), sharphardness1);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "hardness2"), sharphardness2);
-            glUniform1f(glGetUniformLocation(nusharpen->program, "wetness"), sharpwet);
+            glUniform1f(nusharpenuniforms.frequency, infoscale);
+            glUniform1f(nusharpenuniforms.radius1, sharpradius1);
+            glUniform1f(nusharpenuniforms.radius2, sharpradius2);
+            glUniform1f(nusharpenuniforms.blur1, sharpblur1);
+            glUniform1f(nusharpenuniforms.blur2, sharpblur2);
+            glUniform1f(nusharpenuniforms.hardness1, sharphardness1);
+            glUniform1f(nusharpenuniforms.hardness2, sharphardness2);
+            glUniform1f(nusharpenuniforms.wetness, sharpwet);
             glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         }
         checkerr(__LINE__);
         
-        FLIP_SOURCE();
-        BUFFER_DONE();
+        if(currtex == 1)
+            return tex2;
+        return tex1;
+    }
+    void bind_fullscreen_quad()
+    {
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        
+        const vertex vertices[] = {
+            {-1.f, -1.f, 0.5f, 0.0f, 0.0f},
+            { 1.f, -1.f, 0.5f, 1.0f, 0.0f},
+            {-1.f,  1.f, 0.5f, 0.0f, 1.0f},
+            { 1.f,  1.f, 0.5f, 1.0f, 1.0f}
+        };
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
+        checkerr(__LINE__);
+    }
+    void cycle_post()
+    {
+        if(fastgl) return;
+        
+        checkerr(__LINE__);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        
+        bind_fullscreen_quad();
+        
+        auto result = post_passes(FBO, FBOtexture1, FBOtexture2);
+        
+        glBindTexture(GL_TEXTURE_2D, result);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glDrawBuffer(GL_BACK);
         glUseProgram(copy->program);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         checkerr(__LINE__);
@@ -1242,6 +1807,123 @@ struct renderer {
         glEnable(GL_BLEND);
         glEnable(GL_DEPTH_TEST);
     }
+    // draws the page through the scaled page cache, filtering it again only if the scale, page, settings or window changed
+    // returns false if the page can't be cached right now, in which case it has to go through draw_texture and cycle_post
+    bool draw_scaled_page(texture * texture, float z)
+    {
+        if(fastgl or !texture or !texture->complete())
+            return false;
+        
+        int sw = ceil(texture->w*cam_scale);
+        int sh = ceil(texture->h*cam_scale);
+        // huge zoomed-in pages would cost more to filter in full than the window ever shows
+        if(sw < 1 or sh < 1 or sw > max_texture_size or sh > max_texture_size or double(sw)*sh > 4.0*w*h)
+            return false;
+        
+        scaledpagekey key;
+        key.tex = texture;
+        key.scale = cam_scale;
+        key.w = w;
+        key.h = h;
+        float settings[] = {float(usejinc), downscaleradius, float(usedownscalesharpening), float(usesharpen), float(sharpwet),
+            sharpradius1, sharpradius2, sharpblur1, sharpblur2, sharphardness1, sharphardness2};
+        memcpy(key.settings, settings, sizeof(settings));
+        
+        if(!(key == scaledpage_key))
+        {
+            render_scaled_page(texture, sw, sh, z);
+            scaledpage_key = key;
+        }
+        
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glDrawBuffer(GL_BACK);
+        glClearColor(0,0,0,1);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        
+        // the same rounding draw_texture uses, so that the cached page lands on exactly the same pixels
+        float offset_x = round(-cam_x);
+        float offset_y = round(-cam_y);
+        float translation[16] = {
+            1.0f, 0.0f, 0.0f, offset_x,
+            0.0f, 1.0f, 0.0f, offset_y,
+            0.0f, 0.0f, 1.0f,    z,
+            0.0f, 0.0f, 0.0f, 1.0f
+        };
+        const vertex vertices[] = {
+            {0.0f,      0.0f,      0.0f, 0.0f, 0.0f},
+            {float(sw), 0.0f,      0.0f, 1.0f, 0.0f},
+            {0.0f,      float(sh), 0.0f, 0.0f, 1.0f},
+            {float(sw), float(sh), 0.0f, 1.0f, 1.0f}
+        };
+        
+        glUseProgram(fastimageprogram->program);
+        glUniformMatrix4fv(fastimageuniforms.translation, 1, 0, translation);
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBindTexture(GL_TEXTURE_2D, scaledpageresult);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        checkerr(__LINE__);
+        
+        glEnable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+        return true;
+    }
+    void render_scaled_page(texture * texture, int sw, int sh, float z)
+    {
+        checkerr(__LINE__);
+        glActiveTexture(GL_TEXTURE0);
+        if(sw != scaledpage_w or sh != scaledpage_h)
+        {
+            scaledpage_w = sw;
+            scaledpage_h = sh;
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ScaledPageFBO);
+            unsigned int textures[] = {scaledpagetexture1, scaledpagetexture2};
+            for(int i = 0; i < 2; i++)
+            {
+                glBindTexture(GL_TEXTURE_2D, textures[i]);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, sw, sh, 0, GL_RGB, GL_FLOAT, NULL);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0+i, GL_TEXTURE_2D, textures[i], 0);
+            }
+            checkerr(__LINE__);
+        }
+        
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ScaledPageFBO);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        glViewport(0, 0, sw, sh);
+        glClearColor(0,0,0,1);
+        glClear(GL_COLOR_BUFFER_BIT);
+        
+        // draw the whole page as if the window were exactly its size
+        set_projection(sw, sh);
+        
+        auto real_x = cam_x, real_y = cam_y;
+        auto real_w = w, real_h = h;
+        cam_x = 0;
+        cam_y = 0;
+        w = sw;
+        h = sh;
+        draw_texture(texture, 0, 0, z);
+        cam_x = real_x;
+        cam_y = real_y;
+        w = real_w;
+        h = real_h;
+        
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+        bind_fullscreen_quad();
+        scaledpageresult = post_passes(ScaledPageFBO, scaledpagetexture1, scaledpagetexture2);
+        
+        set_projection(w, h);
+        glViewport(0, 0, w, h);
+        checkerr(__LINE__);
+    }
         
     void cycle_end()
     {
@@ -1293,13 +1975,43 @@ struct renderer {
             0.0f, 0.0f, 0.0f, 1.0f
         };
         
-        glUniformMatrix4fv(glGetUniformLocation(primitive->program, "translation"), 1, 0, translation);
+        glUniformMatrix4fv(primitiveuniforms.translation, 1, 0, translation);
         glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         checkerr(__LINE__);
         
         glEnable(GL_DEPTH_TEST);
     }
+    void set_outlines(const std::vector<outlineinstance> & outlines)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, OutlineVBO);
+        if(outlines.size() > outline_capacity)
+        {
+            outline_capacity = std::max(outlines.size(), outline_capacity*2);
+            glBufferData(GL_ARRAY_BUFFER, outline_capacity*sizeof(outlineinstance), nullptr, GL_DYNAMIC_DRAW);
+        }
+        if(outlines.size() > 0)
+            glBufferSubData(GL_ARRAY_BUFFER, 0, outlines.size()*sizeof(outlineinstance), outlines.data());
+        outline_count = outlines.size();
+        checkerr(__LINE__);
+    }
+    // all region overlays in a single draw call
+    void draw_outlines()
+    {
+        if(outline_count == 0)
+            return;
+        
+        glDisable(GL_DEPTH_TEST);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        
+        glUseProgram(outlineprogram->program);
+        glBindVertexArray(OutlineVAO);
+        glUniform3f(outlineuniforms.myCamera, cam_x, cam_y, cam_scale);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, outline_count);
+        checkerr(__LINE__);
+        
+        glEnable(GL_DEPTH_TEST);
+    }
     void set_scissor(float x1, float y1, float x2, float y2, bool nocamera = false)
     {
         glEnable(GL_SCISSOR_TEST);
@@ -1368,7 +2080,7 @@ struct renderer {
             0.0f, 0.0f, 0.0f, 1.0f
         };
         
-        glUniformMatrix4fv(glGetUniformLocation(primitive->program, "translation"), 1, 0, translation);
+        glUniformMatrix4fv(primitiveuniforms.translation, 1, 0, translation);
         glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         checkerr(__LINE__);
@@ -1385,19 +2097,12 @@ struct renderer {
         
         checkerr(__LINE__);
         
-        float w = float(texture->w);
-        float h = float(texture->h);
-        
-        const vertex vertices[] = {
-            {0, 0, 0.0f, 0.0f, 0.0f},
-            {w, 0, 0.0f, 1.0f, 0.0f},
-            {0, h, 0.0f, 0.0f, 1.0f},
-            {w, h, 0.0f, 1.0f, 1.0f}
-        };
+        float offset_x = round(x-cam_x);
+        float offset_y = round(y-cam_y);
         
         float translation[16] = {
-            cam_scale,      0.0f, 0.0f, round(x-cam_x),
-                 0.0f, cam_scale, 0.0f, round(y-cam_y),
+            cam_scale,      0.0f, 0.0f, offset_x,
+                 0.0f, cam_scale, 0.0f, offset_y,
                  0.0f,      0.0f, 1.0f,    z,
                  0.0f,      0.0f, 0.0f, 1.0f
         };
@@ -1406,34 +2111,247 @@ struct renderer {
         if(fastgl)
         {
             glUseProgram(fastimageprogram->program);
-            glUniformMatrix4fv(glGetUniformLocation(fastimageprogram->program, "translation"), 1, 0, translation);
-            glBindTexture(GL_TEXTURE_2D, texture->texid);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            glUniformMatrix4fv(fastimageuniforms.translation, 1, 0, translation);
         }
         else
         {
             glUseProgram(imageprogram->program);
             checkerr(__LINE__);
             
-            glUniformMatrix4fv(glGetUniformLocation(imageprogram->program, "translation"), 1, 0, translation);
-            glUniform2f(glGetUniformLocation(imageprogram->program, "mySize"), w, h);
-            glUniform2f(glGetUniformLocation(imageprogram->program, "myScale"), cam_scale, cam_scale);
-            glUniform1i(glGetUniformLocation(imageprogram->program, "usejinc"), usejinc);
-            glUniform1f(glGetUniformLocation(imageprogram->program, "myradius"), downscaleradius);
-            glBindTexture(GL_TEXTURE_2D, texture->texid);
-            glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-            checkerr(__LINE__);
+            glUniformMatrix4fv(imageuniforms.translation, 1, 0, translation);
+            glUniform2f(imageuniforms.myScale, cam_scale, cam_scale);
+            glUniform1i(imageuniforms.usejinc, usejinc);
+            glUniform1f(imageuniforms.myradius, downscaleradius);
+            bool weighted = usejinc and cam_scale < 1 and update_weight_table();
+            glUniform1i(imageuniforms.myWeightTaps, weighted ? weight_taps : 0);
         }
-    }
-    void draw_text_texture(texture * texture, float x, float y, float z)
-    {
-        if(!texture)
-            return;
         
-        glDisable(GL_DEPTH_TEST);
-        glEnable(GL_BLEND);
+        // sinc is separable, so downscaling with it is done as a horizontal pass and then a vertical one
+        bool separable = !fastgl and !usejinc and cam_scale < 1;
+        
+        // part of the image that's on screen, and a margin around it where tiles are kept resident
+        float view_x1 = -offset_x/cam_scale;
+        float view_y1 = -offset_y/cam_scale;
+        float view_x2 = (this->w-offset_x)/cam_scale;
+        float view_y2 = (this->h-offset_y)/cam_scale;
+        float margin = std::max(this->w, this->h)/cam_scale/2;
+        
+        for(size_t i = 0; i < texture->tiles.size(); i++)
+        {
+            auto & t = texture->tiles[i];
+            auto overlaps = [&](float m)
+            {
+                return t.core_x + t.core_w >= view_x1-m and t.core_x <= view_x2+m
+                   and t.core_y + t.core_h >= view_y1-m and t.core_y <= view_y2+m;
+            };
+            if(texture->tiled)
+            {
+                if(!t.texid and overlaps(margin))
+                    queue_tile(texture, i);
+                else if(t.texid and !overlaps(margin*2))
+                {
+                    unqueue_tile(texture, i);
+                    texture->release_tile(i);
+                }
+            }
+            // rows that haven't been streamed in yet would show whatever was in the texture's memory before
+            if(!texture->tile_drawable(i) or !overlaps(0))
+                continue;
+            
+            float x1 = t.core_x;
+            float y1 = t.core_y;
+            float x2 = t.core_x + t.core_w;
+            float y2 = t.core_y + t.core_h;
+            float u1 = float(t.core_x - t.x)/t.w;
+            float v1 = float(t.core_y - t.y)/t.h;
+            float u2 = float(t.core_x + t.core_w - t.x)/t.w;
+            float v2 = float(t.core_y + t.core_h - t.y)/t.h;
+            
+            const vertex vertices[] = {
+                {x1, y1, 0.0f, u1, v1},
+                {x2, y1, 0.0f, u2, v1},
+                {x1, y2, 0.0f, u1, v2},
+                {x2, y2, 0.0f, u2, v2}
+            };
+            
+            if(!fastgl)
+                glUniform2f(imageuniforms.mySize, t.w, t.h);
+            glBindTexture(GL_TEXTURE_2D, t.texid);
+            if(separable and !sinc_horizontal_pass(t, offset_x, offset_y))
+                continue;
+            glBindVertexArray(VAO);
+            glBindBuffer(GL_ARRAY_BUFFER, VBO);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            checkerr(__LINE__);
+        }
+        
+        if(separable)
+            glUniform1i(imageuniforms.myVerticalPass, 0);
+    }
+    // level, radius and scale the downscaling shaders actually filter with: below a quarter, they filter the first mipmap at twice the scale
+    void downscale_parameters(int * lod, float * radius, float * scale)
+    {
+        *lod = 0;
+        *radius = downscaleradius;
+        *scale = cam_scale;
+        if(*scale > 0 and *scale < 0.25)
+        {
+            *radius /= 2;
+            *scale *= 2;
+            *lod += 1;
+        }
+        if(*radius < 1) *radius = 1;
+    }
+    // rebuilds the jinc weight table if the scale or radius changed; returns false if it would be too big, meaning the shader has to compute weights itself
+    bool update_weight_table()
+    {
+        int lod;
+        float radius, scale;
+        downscale_parameters(&lod, &radius, &scale);
+        if(scale == weight_scale and radius == weight_radius)
+            return weight_taps > 0;
+        weight_scale = scale;
+        weight_radius = radius;
+        
+        // taps from 1-taps/2 to taps/2 around the source pixel, which covers the radius at any phase
+        int reach = int(ceil(radius/scale));
+        int taps = reach*2 + 2;
+        if(taps*taps > max_texture_size)
+        {
+            weight_taps = 0;
+            return false;
+        }
+        weight_taps = taps;
+        int first = 1 - taps/2;
+        
+        // every tap distance is scale*sqrt(n)/16 for an integer n, so the window only gets evaluated once per distinct n
+        int maxoffset = (std::max(-first, taps/2) + 1)*16;
+        std::vector<float> windowed(2*maxoffset*maxoffset + 1, NAN);
+        auto window = [&](int n)
+        {
+            if(std::isnan(windowed[n]))
+            {
+                windowed[n] = jinc_window(scale*sqrt(double(n))/16, radius);
+            }
+            return windowed[n];
+        };
+        
+        std::vector<float> weights(size_t(taps)*taps*256);
+        for(int qy = 0; qy < 16; qy++)
+        {
+            for(int qx = 0; qx < 16; qx++)
+            {
+                float * row = &weights[size_t(qy*16 + qx)*taps*taps];
+                double sum = 0;
+                for(int j = 0; j < taps; j++)
+                {
+                    for(int i = 0; i < taps; i++)
+                    {
+                        int dx = (first+i)*16 - qx;
+                        int dy = (first+j)*16 - qy;
+                        row[j*taps + i] = window(dx*dx + dy*dy);
+                        sum += row[j*taps + i];
+                    }
+                }
+                for(int i = 0; i < taps*taps; i++)
+                    row[i] /= sum;
+            }
+        }
+        
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D, weighttexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, taps*taps, 256, 0, GL_RED, GL_FLOAT, weights.data());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glActiveTexture(GL_TEXTURE0);
+        checkerr(__LINE__);
+        return true;
+    }
+    // filters the on-screen part of a tile along x into SincFBO, with enough extra rows for the vertical pass
+    // leaves imageprogram set up to do the vertical pass when the tile's quad is drawn; returns false if the tile is off screen
+    bool sinc_horizontal_pass(const texture::tile & t, float offset_x, float offset_y)
+    {
+        int lod;
+        float radius, scale;
+        downscale_parameters(&lod, &radius, &scale);
+        int levelheight = std::max(t.h >> lod, 1);
+        
+        int column_lo = std::max(0, int(floor(offset_x + t.core_x*cam_scale)));
+        int column_hi = std::min(w, int(ceil(offset_x + (t.core_x + t.core_w)*cam_scale)));
+        float screen_y1 = std::max(0.0f, offset_y + t.core_y*cam_scale);
+        float screen_y2 = std::min(float(h), offset_y + (t.core_y + t.core_h)*cam_scale);
+        if(column_hi <= column_lo or screen_y2 <= screen_y1)
+            return false;
+        
+        // source rows (at the chosen level) the vertical pass can touch
+        auto source_row = [&](float y) { return ((y - offset_y)/cam_scale - t.y)*levelheight/t.h; };
+        int reach = int(ceil(radius/scale)) + 2;
+        int row_lo = int(floor(source_row(screen_y1) - 0.5)) - reach;
+        int row_hi = int(floor(source_row(screen_y2) - 0.5)) + reach;
+        int columns = column_hi - column_lo;
+        int rows = row_hi - row_lo + 1;
+        
+        GLint previous_fbo;
+        GLint previous_viewport[4];
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+        glGetIntegerv(GL_VIEWPORT, previous_viewport);
+        bool blending = glIsEnabled(GL_BLEND);
+        
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, SincFBO);
+        if(columns > sincpass_w or rows > sincpass_h)
+        {
+            sincpass_w = std::max(columns, sincpass_w);
+            sincpass_h = std::max(rows, sincpass_h);
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, sincpasstexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sincpass_w, sincpass_h, 0, GL_RGBA, GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sincpasstexture, 0);
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+            glActiveTexture(GL_TEXTURE0);
+            checkerr(__LINE__);
+        }
+        glViewport(0, 0, columns, rows);
+        glDisable(GL_BLEND);
+        
+        bind_fullscreen_quad();
+        glUseProgram(sinchorizontal->program);
+        glUniform1f(sinchorizontaluniforms.myScale, cam_scale);
+        glUniform1f(sinchorizontaluniforms.myradius, downscaleradius);
+        // gl_FragCoord.x of output column c is c+0.5, which is screen column column_lo+c+0.5
+        glUniform2f(sinchorizontaluniforms.myTexMap,
+            1.0f/(cam_scale*t.w), ((column_lo - offset_x)/cam_scale - t.x)/t.w);
+        glUniform1i(sinchorizontaluniforms.myRowOffset, row_lo);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        checkerr(__LINE__);
+        
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previous_fbo);
+        glViewport(previous_viewport[0], previous_viewport[1], previous_viewport[2], previous_viewport[3]);
+        if(blending)
+            glEnable(GL_BLEND);
+        
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, sincpasstexture);
+        glActiveTexture(GL_TEXTURE0);
+        
+        glUseProgram(imageprogram->program);
+        glUniform1i(imageuniforms.myVerticalPass, 1);
+        glUniform1i(imageuniforms.myColumnOffset, column_lo);
+        glUniform1i(imageuniforms.myRowOffset, row_lo);
+        checkerr(__LINE__);
+        return true;
+    }
+    // glyph quads as triangles, positioned relative to x, y and grouped by atlas
+    void draw_text(const std::vector<vertex> & vertices, const std::vector<textbatch> & batches, float x, float y)
+    {
+        if(vertices.size() == 0)
+            return;
+        
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
         
         checkerr(__LINE__);
         glUseProgram(mytextprogram->program);
@@ -1441,16 +2359,6 @@ struct renderer {
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         checkerr(__LINE__);
         
-        float w = float(texture->w);
-        float h = float(texture->h);
-        
-        const vertex vertices[] = {
-            {0, 0, 0.0f, 0.0f, 0.0f},
-            {w, 0, 0.0f, 1.0f, 0.0f},
-            {0, h, 0.0f, 0.0f, 1.0f},
-            {w, h, 0.0f, 1.0f, 1.0f}
-        };
-        
         float translation[16] = {
             1.0f, 0.0f, 0.0f,    x,
             0.0f, 1.0f, 0.0f,    y,
@@ -1458,10 +2366,14 @@ struct renderer {
             0.0f, 0.0f, 0.0f, 1.0f
         };
         
-        glUniformMatrix4fv(glGetUniformLocation(mytextprogram->program, "translation"), 1, 0, translation);
-        glBindTexture(GL_TEXTURE_2D, texture->texid);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,  GL_DYNAMIC_DRAW);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glUniformMatrix4fv(textuniforms.translation, 1, 0, translation);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(vertex), vertices.data(), GL_DYNAMIC_DRAW);
+        glActiveTexture(GL_TEXTURE0);
+        for(const auto & batch : batches)
+        {
+            glBindTexture(GL_TEXTURE_2D, atlases[batch.page].texid);
+            glDrawArrays(GL_TRIANGLES, batch.first, batch.count);
+        }
         checkerr(__LINE__);
     }
 };
@@ -1483,6 +2395,325 @@ bool looks_like_image_filename(std::string string)
         return true;
 }
 
+// sorts numbers embedded in filenames by value, so that page2 comes before page10
+bool natural_less(const std::string & a, const std::string & b)
+{
+    auto numeric = [](const char & c) {return (c >= '0' and c <= '9');};
+    size_t i;
+    for(i = 0; i < a.length() and i < b.length() and a[i] == b[i]; i++);
+    // same length, identical
+    if(i == a.length() and i == b.length())
+        return false;
+    // ran out of length before a difference
+    if(i < a.length() and i >= b.length())
+        return false;
+    if(i < b.length() and i >= a.length())
+        return true;
+    char c1 = a[i];
+    char c2 = b[i];
+    if(c1 == 0)
+        return true;
+    if(c2 == 0)
+        return false;
+    // difference is not numeric
+    if(!numeric(c1) and !numeric(c2))
+        return c1 < c2;
+    
+    size_t start;
+    if(i > 0 and numeric(a[i-1]))
+        start = i-1;
+    else
+        start = i;
+    
+    size_t end1, end2;
+    for(end1 = 0; start+end1 < a.length() and numeric(a[start+end1]); end1++);
+    for(end2 = 0; start+end2 < b.length() and numeric(b[start+end2]); end2++);
+    if(end1 == 0 or end2 == 0) return c1 < c2;
+    
+    try
+    {
+        int num1 = std::stoll(a.substr(start, end1));
+        int num2 = std::stoll(b.substr(start, end2));
+        return (num1 < num2);
+    }
+    catch(const std::invalid_argument & e)
+    {
+        return c1 < c2;
+    }
+    catch(const std::out_of_range & e)
+    {
+        return c1 < c2;
+    }
+}
+
+bool looks_like_archive_filename(std::string string)
+{
+    if(string.length() < 4) return false;
+    auto ext = string.substr(string.length()-4);
+    for(auto & c : ext)
+        c = tolower(c);
+    return ext == ".zip" or ext == ".cbz";
+}
+
+// a .zip/.cbz opened as a page source; its pages have paths of the form archivepath/entryname
+struct pagearchive {
+    std::string path;
+    ziparchive zip;
+    std::map<std::string, size_t> by_name;
+};
+
+// only modified while starting up, before any pages are decoded, so worker threads can read it without locking
+std::map<std::string, pagearchive *> archives;
+
+pagearchive * open_archive(const std::string & path)
+{
+    auto archive = new pagearchive;
+    if(!zip_open(path.data(), &archive->zip))
+    {
+        delete archive;
+        return nullptr;
+    }
+    archive->path = path;
+    for(size_t i = 0; i < archive->zip.entries.size(); i++)
+        archive->by_name[archive->zip.entries[i].name] = i;
+    archives[path] = archive;
+    return archive;
+}
+
+bool find_archive_entry(const std::string & path, pagearchive ** archive, const zipentry ** entry)
+{
+    for(const auto & pair : archives)
+    {
+        const auto & prefix = pair.first;
+        if(path.length() <= prefix.length()+1 or path.compare(0, prefix.length(), prefix) != 0 or path[prefix.length()] != '/')
+            continue;
+        auto found = pair.second->by_name.find(path.substr(prefix.length()+1));
+        if(found == pair.second->by_name.end())
+            continue;
+        *archive = pair.second;
+        *entry = &pair.second->zip.entries[found->second];
+        return true;
+    }
+    return false;
+}
+
+// stored entries are decoded straight out of the mapping; deflated ones are inflated first, which happens on whichever thread is decoding the page
+unsigned char * decode_archive_entry(pagearchive * archive, const zipentry & entry, int * w, int * h, int * n)
+{
+    auto src = zip_entry_data(&archive->zip, entry);
+    if(!src or entry.compressed_size > INT_MAX or entry.size > INT_MAX)
+        return nullptr;
+    
+    if(entry.method == 0)
+        return stbi_load_from_memory(src, int(entry.compressed_size), w, h, n, 0);
+    
+    if(entry.method == 8)
+    {
+        int len = 0;
+        auto inflated = stbi_zlib_decode_malloc_guesssize_headerflag((const char *)src, int(entry.compressed_size), std::max(int(entry.size), 1), &len, 0);
+        if(!inflated) return nullptr;
+        auto data = stbi_load_from_memory((stbi_uc *)inflated, len, w, h, n, 0);
+        free(inflated);
+        return data;
+    }
+    
+    puts("unsupported compression method in archive");
+    puts(entry.name.data());
+    return nullptr;
+}
+
+// decodes pages on worker threads so that turning to an already-decoded page only costs the upload
+struct pagedecoder {
+    std::mutex mutex;
+    std::condition_variable wakeup; // for workers: new jobs or quitting
+    std::condition_variable finished; // for take(): an in-flight decode finished
+    std::deque<std::string> queue; // front is most wanted
+    std::set<std::string> inflight;
+    std::map<std::string, decodedimage> ready;
+    std::vector<std::thread> workers;
+    bool quitting = false;
+    // called on the decoding thread with each page it decodes, if set; has to be set before the first prefetch
+    std::function<void(const std::string & path, const decodedimage & img)> decoded;
+
+    pagedecoder(int threads)
+    {
+        if(threads < 1) threads = 1;
+        for(int i = 0; i < threads; i++)
+            workers.push_back(std::thread([this](){ work(); }));
+    }
+    ~pagedecoder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+            queue.clear();
+        }
+        wakeup.notify_all();
+        for(auto & thread : workers)
+            thread.join();
+        for(auto & pair : ready)
+            release_image(pair.second);
+    }
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wakeup.wait(lock, [this](){ return quitting or queue.size() > 0; });
+            if(quitting) return;
+
+            std::string path = queue.front();
+            queue.pop_front();
+            inflight.insert(path);
+
+            lock.unlock();
+            auto img = decode_image(path.data());
+            if(decoded and img.data)
+                decoded(path, img);
+            lock.lock();
+
+            inflight.erase(path);
+            if(ready.count(path) == 0)
+                ready[path] = img;
+            else
+                release_image(img);
+            finished.notify_all();
+        }
+    }
+    // replaces the pending queue with the given pages, most wanted first
+    // decoded pages that are no longer wanted are thrown away
+    void prefetch(const std::vector<std::string> & wanted)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.clear();
+        for(auto it = ready.begin(); it != ready.end();)
+        {
+            if(std::find(wanted.begin(), wanted.end(), it->first) == wanted.end())
+            {
+                release_image(it->second);
+                it = ready.erase(it);
+            }
+            else
+                it++;
+        }
+        for(const auto & path : wanted)
+        {
+            if(ready.count(path) == 0 and inflight.count(path) == 0)
+                queue.push_back(path);
+        }
+        wakeup.notify_all();
+    }
+    // hands over ownership of the decoded page, decoding it on this thread if nobody has started on it yet
+    decodedimage take(const std::string & path)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&](){ return inflight.count(path) == 0; });
+        if(ready.count(path) > 0)
+        {
+            auto img = ready[path];
+            ready.erase(path);
+            return img;
+        }
+        auto it = std::find(queue.begin(), queue.end(), path);
+        if(it != queue.end())
+            queue.erase(it);
+        lock.unlock();
+
+        return decode_image(path.data());
+    }
+    // lets f look at a page that's already been decoded without taking it; false if it isn't ready yet
+    // f runs with the lock held, which stalls the decoding threads, so it should only copy out what it needs
+    bool peek(const std::string & path, const std::function<void(const decodedimage & img)> & f)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ready.find(path);
+        if(it == ready.end())
+            return false;
+        f(it->second);
+        return true;
+    }
+};
+
+// recently viewed pages (CPU copy and GL texture), least recently used ones evicted past page_cache_bytes
+struct pagecache {
+    struct entry {
+        renderer::texture * tex;
+        uint64_t lastuse;
+    };
+    std::map<std::string, entry> entries;
+    renderer * myrenderer;
+    uint64_t clock = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t bytes = 0;
+    
+    pagecache(renderer * myrenderer)
+    {
+        this->myrenderer = myrenderer;
+    }
+    // CPU copy plus the GL texture and its mip chain (which adds about a third)
+    static size_t texture_bytes(renderer::texture * tex)
+    {
+        size_t cpu = size_t(tex->w)*tex->h*tex->n;
+        size_t gl = size_t(tex->w)*tex->h*tex->n*4/3;
+        return cpu + gl;
+    }
+    bool has(const std::string & path)
+    {
+        return entries.count(path) > 0;
+    }
+    // like get(), but doesn't count as a use
+    renderer::texture * peek(const std::string & path)
+    {
+        auto it = entries.find(path);
+        return it == entries.end() ? nullptr : it->second.tex;
+    }
+    // returns nullptr on a miss
+    renderer::texture * get(const std::string & path)
+    {
+        auto it = entries.find(path);
+        if(it == entries.end())
+        {
+            misses++;
+            report("miss");
+            return nullptr;
+        }
+        hits++;
+        it->second.lastuse = ++clock;
+        report("hit");
+        return it->second.tex;
+    }
+    void put(const std::string & path, renderer::texture * tex)
+    {
+        if(has(path)) return;
+        entries[path] = {tex, ++clock};
+        bytes += texture_bytes(tex);
+    }
+    // never evicts the page being displayed, even if it alone is over budget
+    void trim(renderer::texture * keep)
+    {
+        while(bytes > size_t(double(page_cache_bytes)) and entries.size() > 1)
+        {
+            auto oldest = entries.end();
+            for(auto it = entries.begin(); it != entries.end(); it++)
+            {
+                if(it->second.tex == keep) continue;
+                if(oldest == entries.end() or it->second.lastuse < oldest->second.lastuse)
+                    oldest = it;
+            }
+            if(oldest == entries.end()) break;
+            
+            bytes -= texture_bytes(oldest->second.tex);
+            myrenderer->delete_texture(oldest->second.tex);
+            entries.erase(oldest);
+        }
+    }
+    void report(const char * what)
+    {
+        printf("page cache %s: %d pages, %.1f MB, hit rate %.1f%% (%d/%d)\n", what, int(entries.size()), bytes/1048576.0,
+            100.0*hits/std::max(hits+misses, uint64_t(1)), int(hits), int(hits+misses));
+    }
+};
 
 void config_hook(const std::string & name, value val)
 {
@@ -1522,6 +2753,9 @@ void config_hook(const std::string & name, std::string text)
 std::mutex scrollMutex;
 float scroll = 0;
 
+// set by anything that changes what's on screen without going through the camera, page, regions or subtitle
+bool redraw_requested = true;
+
 void myScrollEventCallback(GLFWwindow * win, double x, double y)
 {
     scrollMutex.lock();
@@ -1539,6 +2773,8 @@ void myKeyEventCallback(GLFWwindow * win, int key, int scancode, int action, int
 {
     if(action == GLFW_PRESS)
     {
+        // most keys here change rendering settings
+        redraw_requested = true;
         if(key == GLFW_KEY_O)
         {
             light_downscaling = !light_downscaling;
@@ -1807,47 +3043,355 @@ FILE * profile_fopen(const char * fname, const char * mode)
     return wrap_fopen(path.data(), mode);
 }
 
-void load_config()
+// names of the entries in a directory, or nothing if it can't be opened
+std::vector<std::string> list_directory(const std::string & path)
 {
-    auto f = profile_fopen("config.txt", "rb");
-    if(!f)
-    {
-        puts("could not open config file");
-        return;
-    }
+    std::vector<std::string> names;
     
-    char * text;
-    while(freadline(f, &text) == 0)
+    #ifdef _WIN32
+    
+    int status;
+    wchar_t * dircstr = (wchar_t *)utf8_to_utf16((uint8_t *)path.data(), &status);
+    if(!dircstr) return names;
+    auto dir = _wopendir(dircstr);
+    free(dircstr);
+    
+    #else
+    
+    auto dir = opendir(path.data());
+    
+    #endif
+    
+    if(!dir) return names;
+    
+    #ifdef _WIN32
+    
+    _wdirent * myent = _wreaddir(dir);
+    
+    #else
+    
+    dirent * myent = readdir(dir);
+    
+    #endif
+    
+    while(myent)
     {
-        // This is the normal way to split a string in C++. Fuck the committee.
-        auto str = std::string(text);
-        free(text);
+        #ifdef _WIN32
         
-        const std::string delimiter = ":";
+        char * text = (char *)utf16_to_utf8((uint16_t *)myent->d_name, &status);
+        if(text)
+            names.push_back(std::string(text));
+        free(text);
+        myent = _wreaddir(dir);
         
-        const auto start = str.find(delimiter);
-        const auto end = start + delimiter.length();
-        const std::string first = str.substr(0, start);
-        const std::string second = str.substr(end);
+        #else
         
-        config[first] = {double_from_string(second), second, is_number(second)};
+        names.push_back(std::string(myent->d_name));
+        myent = readdir(dir);
         
-        config_hook(first, config[first]);
+        #endif
     }
     
-    fclose(f);
+    #ifdef _WIN32
+    _wclosedir(dir);
+    #else
+    closedir(dir);
+    #endif
+    
+    return names;
 }
 
-bool fontinitialized = false;
-FT_Face fontface;
-FT_Library freetype;
-hb_font_t * hbfont = 0;
-uint8_t * fontbuffer = 0;
-
-void init_font()
+uint64_t fnv1a(const void * data, size_t len, uint64_t hash = 0xCBF29CE484222325)
 {
-    auto error = FT_Init_FreeType(&freetype);
-    if(error)
+    auto bytes = (const uint8_t *)data;
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+// wide fingerprint for content-addressed caches: FNV-1a next to a word-at-a-time multiply-xorshift hash,
+// so that a collision would have to happen in two unrelated hashes at once
+struct hash128 {
+    uint64_t a = 0xCBF29CE484222325;
+    uint64_t b = 0x9E3779B97F4A7C15;
+    void add(const void * data, size_t len)
+    {
+        a = fnv1a(data, len, a);
+        auto bytes = (const uint8_t *)data;
+        size_t i = 0;
+        for(; i + 8 <= len; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes+i, 8);
+            b = (b ^ word) * 0xFF51AFD7ED558CCD;
+            b ^= b >> 32;
+        }
+        for(; i < len; i++)
+        {
+            b = (b ^ bytes[i]) * 0xC4CEB9FE1A85EC53;
+            b ^= b >> 29;
+        }
+        b ^= len;
+    }
+    // length first, so that neighboring strings can't trade characters
+    void add(const std::string & text)
+    {
+        uint64_t len = text.length();
+        add(&len, sizeof(len));
+        add(text.data(), text.length());
+    }
+    bool operator<(const hash128 & other) const
+    {
+        return a < other.a or (a == other.a and b < other.b);
+    }
+};
+
+// decoded pages stored under PROFILE/pagecache/ in the format they get uploaded in, so that revisiting a folder can map them instead of decoding
+// files are named after a hash of the source path, size and mtime; least recently used files get deleted past disk_cache_bytes
+struct diskcache {
+    struct header {
+        char magic[4];
+        uint32_t version;
+        uint64_t source_size;
+        int64_t source_mtime;
+        uint32_t w, h, n;
+        uint32_t pathlength; // source path follows the header
+        uint64_t pixel_offset;
+    };
+    static constexpr uint32_t version = 1;
+    
+    std::mutex mutex; // held while updating total or trimming
+    size_t capacity = 0; // copied from disk_cache_bytes by open(); zero disables the cache
+    uint64_t total = 0; // bytes in the directory as of the last scan, plus what's been stored since
+    
+    std::string directory()
+    {
+        return profile() + "pagecache/";
+    }
+    // on the main thread, before any decoding; clears out temp files left behind by crashes and measures the cache once
+    void open(size_t capacity)
+    {
+        this->capacity = capacity;
+        if(capacity == 0) return;
+        
+        auto now = time(nullptr);
+        for(const auto & name : list_directory(directory()))
+        {
+            if(name.find(".nzp.tmp") == std::string::npos) continue;
+            auto fname = directory() + name;
+            int64_t mtime;
+            // recent ones might still be getting written by another copy of nezuyomi
+            if(wrap_stat(fname.data(), nullptr, &mtime) and now - mtime > 600)
+                wrap_remove(fname.data());
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        trim();
+    }
+    std::string filename_for(const std::string & path, uint64_t size, int64_t mtime)
+    {
+        uint64_t hash = fnv1a(path.data(), path.length());
+        hash = fnv1a(&size, sizeof(size), hash);
+        hash = fnv1a(&mtime, sizeof(mtime), hash);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.nzp", (unsigned long long)hash);
+        return directory() + name;
+    }
+    decodedimage load(const std::string & path, uint64_t size, int64_t mtime)
+    {
+        decodedimage img;
+        auto fname = filename_for(path, size, mtime);
+        
+        auto mapping = new mappedfile;
+        if(!wrap_mmap(fname.data(), mapping))
+        {
+            delete mapping;
+            return img;
+        }
+        
+        header head;
+        bool valid = mapping->size >= sizeof(head);
+        if(valid)
+        {
+            memcpy(&head, mapping->data, sizeof(head));
+            valid = memcmp(head.magic, "NZPC", 4) == 0 and head.version == version
+                and head.source_size == size and head.source_mtime == mtime
+                and head.pathlength == path.length() and sizeof(head) + head.pathlength <= mapping->size
+                and memcmp(mapping->data + sizeof(head), path.data(), path.length()) == 0
+                and (head.n == 1 or head.n == 4)
+                and head.pixel_offset + uint64_t(head.w)*head.h*head.n <= mapping->size;
+        }
+        if(!valid)
+        {
+            wrap_munmap(mapping);
+            delete mapping;
+            return img;
+        }
+        
+        // mtime doubles as the last use time for trimming
+        wrap_touch(fname.data());
+        
+        img.data = mapping->data + head.pixel_offset;
+        img.w = head.w;
+        img.h = head.h;
+        img.n = head.n;
+        img.mapping = mapping;
+        puts("page loaded from disk cache");
+        return img;
+    }
+    void store(const std::string & path, uint64_t size, int64_t mtime, const decodedimage & img)
+    {
+        wrap_mkdir(directory().data());
+        
+        auto fname = filename_for(path, size, mtime);
+        // written under a per-thread name and renamed into place so readers never see a partial file
+        auto tempname = fname + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        
+        auto f = wrap_fopen(tempname.data(), "wb");
+        if(!f) return;
+        
+        header head;
+        memcpy(head.magic, "NZPC", 4);
+        head.version = version;
+        head.source_size = size;
+        head.source_mtime = mtime;
+        head.w = img.w;
+        head.h = img.h;
+        head.n = img.n;
+        head.pathlength = path.length();
+        head.pixel_offset = (sizeof(head) + path.length() + 63) & ~uint64_t(63);
+        
+        size_t pixelbytes = size_t(img.w)*img.h*img.n;
+        
+        std::vector<char> padding(head.pixel_offset - sizeof(head) - path.length(), 0);
+        bool ok = fwrite(&head, sizeof(head), 1, f) == 1
+              and fwrite(path.data(), 1, path.length(), f) == path.length()
+              and fwrite(padding.data(), 1, padding.size(), f) == padding.size()
+              and fwrite(img.data, 1, pixelbytes, f) == pixelbytes;
+        ok = (fclose(f) == 0) and ok;
+        
+        if(!ok or !wrap_rename(tempname.data(), fname.data()))
+        {
+            puts("failed to write page to disk cache");
+            wrap_remove(tempname.data());
+            return;
+        }
+        
+        // only look at the whole directory once it might be over capacity
+        std::lock_guard<std::mutex> lock(mutex);
+        total += head.pixel_offset + pixelbytes;
+        if(total > capacity)
+            trim();
+    }
+    // measures the directory and deletes the least recently used files until the cache fits in capacity; needs the lock held
+    void trim()
+    {
+        struct cachefile {
+            std::string fname;
+            uint64_t size;
+            int64_t mtime;
+        };
+        std::vector<cachefile> files;
+        total = 0;
+        for(const auto & name : list_directory(directory()))
+        {
+            if(name.length() < 4 or name.substr(name.length()-4) != ".nzp") continue;
+            cachefile file = {directory() + name, 0, 0};
+            if(!wrap_stat(file.fname.data(), &file.size, &file.mtime)) continue;
+            total += file.size;
+            files.push_back(file);
+        }
+        if(total <= capacity) return;
+        
+        std::sort(files.begin(), files.end(), [](const cachefile & a, const cachefile & b){ return a.mtime < b.mtime; });
+        for(const auto & file : files)
+        {
+            if(total <= capacity) break;
+            if(wrap_remove(file.fname.data()))
+                total -= file.size;
+        }
+    }
+};
+
+diskcache pagediskcache;
+
+decodedimage decode_image(const char * filename)
+{
+    pagearchive * archive = nullptr;
+    const zipentry * entry = nullptr;
+    bool in_archive = find_archive_entry(filename, &archive, &entry);
+    
+    // pages inside archives are only as fresh as the archive itself
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool cacheable = pagediskcache.capacity > 0 and wrap_stat(in_archive ? archive->path.data() : filename, &size, &mtime);
+    if(cacheable)
+    {
+        auto img = pagediskcache.load(filename, size, mtime);
+        if(img.data) return img;
+    }
+    
+    decodedimage img;
+    if(in_archive)
+        img.data = decode_archive_entry(archive, *entry, &img.w, &img.h, &img.n);
+    else
+    {
+        auto f = wrap_fopen(filename, "rb");
+        if(!f) return img;
+        img.data = stbi_load_from_file(f, &img.w, &img.h, &img.n, 0);
+        fclose(f);
+    }
+    img = to_upload_format(img);
+    
+    if(cacheable and img.data)
+        pagediskcache.store(filename, size, mtime, img);
+    return img;
+}
+
+void load_config()
+{
+    auto f = profile_fopen("config.txt", "rb");
+    if(!f)
+    {
+        puts("could not open config file");
+        return;
+    }
+    
+    char * text;
+    while(freadline(f, &text) == 0)
+    {
+        // This is the normal way to split a string in C++. Fuck the committee.
+        auto str = std::string(text);
+        free(text);
+        
+        const std::string delimiter = ":";
+        
+        const auto start = str.find(delimiter);
+        const auto end = start + delimiter.length();
+        const std::string first = str.substr(0, start);
+        const std::string second = str.substr(end);
+        
+        config[first] = {double_from_string(second), second, is_number(second)};
+        
+        config_hook(first, config[first]);
+    }
+    
+    fclose(f);
+}
+
+bool fontinitialized = false;
+FT_Face fontface;
+FT_Library freetype;
+hb_font_t * hbfont = 0;
+uint8_t * fontbuffer = 0;
+
+void init_font()
+{
+    auto error = FT_Init_FreeType(&freetype);
+    if(error)
     {
         puts("failed to initialize freetype");
         return;
@@ -1924,7 +3468,7 @@ uint32_t glyph_lookup(uint32_t codepoint)
 
 struct glyph
 {
-    renderer::texture * texture = 0;
+    renderer::atlasslot slot;
     int w, h, x, y;
     uint64_t index;
     renderer * myrenderer = 0;
@@ -1948,23 +3492,19 @@ struct glyph
         x = fontface->glyph->bitmap_left;
         y = fontface->glyph->bitmap_top;
         
-        if(bitmap.buffer && bitmap.pixel_mode == FT_PIXEL_MODE_GRAY)
+        // blank glyphs like spaces have no bitmap at all
+        if(w == 0 or h == 0)
+            return;
+        
+        if(bitmap.buffer && bitmap.pixel_mode == FT_PIXEL_MODE_GRAY && bitmap.pitch >= 0)
         {
-            texture = myrenderer->load_texture(bitmap.buffer, w, h);
-            if(!texture)
-                puts("failed to generate texture");
-            else
-                puts("rendered glyph");
+            if(!myrenderer->atlas_add(bitmap.buffer, w, h, bitmap.pitch, &slot))
+                puts("glyph too big for atlas");
         }
         else
             puts("failed to render glyph");
         
     }
-    ~glyph()
-    {
-        puts("deleting texture");
-        myrenderer->delete_texture(texture);
-    }
 };
 
 struct posdata
@@ -1980,14 +3520,116 @@ struct posdata
 };
 
 std::map<hb_codepoint_t, glyph*> textcache;
+uint64_t subtitle_serials = 0;
+
+// everything about a line of text that only depends on the text, font and size
+struct shapedtext
+{
+    std::vector<hb_codepoint_t> glyphs;
+    std::vector<posdata> positions;
+    // ready to draw, relative to the start of the baseline
+    std::vector<vertex> vertices;
+    std::vector<renderer::textbatch> batches;
+};
+
+std::shared_ptr<const shapedtext> shape_text(const std::string & text, float size, renderer * myrenderer)
+{
+    auto shaped = std::make_shared<shapedtext>();
+    
+    auto buffer = hb_buffer_create();
+    hb_buffer_add_utf8(buffer, text.data(), text.length(), 0, text.length());
+    hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+    hb_buffer_set_script(buffer, HB_SCRIPT_COMMON);
+    hb_buffer_set_language(buffer, hb_language_get_default());
+    
+    unsigned int glyph_count;
+    hb_shape(hbfont, buffer, NULL, 0);
+    hb_glyph_info_t *     glyph_info = hb_buffer_get_glyph_infos    (buffer, &glyph_count);
+    hb_glyph_position_t * glyph_pos  = hb_buffer_get_glyph_positions(buffer, &glyph_count);
+    
+    for(unsigned int i = 0; i < glyph_count; ++i)
+    {
+        if(textcache.count(glyph_info[i].codepoint) == 0)
+            textcache[glyph_info[i].codepoint] = new glyph(glyph_info[i], glyph_pos[i], size, myrenderer);
+        shaped->glyphs.push_back(glyph_info[i].codepoint);
+        shaped->positions.push_back(posdata(glyph_info[i], glyph_pos[i], *textcache[glyph_info[i].codepoint]));
+    }
+    
+    hb_buffer_destroy(buffer);
+    
+    // quads for every glyph, grouped by atlas so that each atlas only gets drawn once
+    std::map<int, std::vector<vertex>> pages;
+    float x = 0;
+    float y = 0;
+    for(unsigned int i = 0; i < shaped->glyphs.size(); i++)
+    {
+        const auto & glyph = textcache[shaped->glyphs[i]];
+        const auto & pos = shaped->positions[i];
+        const auto & slot = glyph->slot;
+        
+        if(slot.page >= 0)
+        {
+            float x1 = round(x+pos.x);
+            float y1 = round(y+pos.y);
+            float x2 = x1+glyph->w;
+            float y2 = y1+glyph->h;
+            auto & page = pages[slot.page];
+            page.push_back({x1, y1, 0.0f, slot.u1, slot.v1});
+            page.push_back({x2, y1, 0.0f, slot.u2, slot.v1});
+            page.push_back({x1, y2, 0.0f, slot.u1, slot.v2});
+            page.push_back({x2, y1, 0.0f, slot.u2, slot.v1});
+            page.push_back({x1, y2, 0.0f, slot.u1, slot.v2});
+            page.push_back({x2, y2, 0.0f, slot.u2, slot.v2});
+        }
+        
+        x += pos.x_advance;
+        y += pos.y_advance;
+    }
+    for(auto & page : pages)
+    {
+        shaped->batches.push_back({page.first, int(shaped->vertices.size()), int(page.second.size())});
+        shaped->vertices.insert(shaped->vertices.end(), page.second.begin(), page.second.end());
+    }
+    
+    return shaped;
+}
+
+// recently shown text, so that status messages and re-clicked regions don't get shaped again
+constexpr size_t shapecache_limit = 256;
+std::list<std::pair<std::string, std::shared_ptr<const shapedtext>>> shapecache;
+std::unordered_map<std::string, decltype(shapecache)::iterator> shapecache_index;
+
+std::shared_ptr<const shapedtext> cached_shape_text(const std::string & text, float size, renderer * myrenderer)
+{
+    std::string key = std::string(fontname) + '\0' + std::to_string(size) + '\0' + text;
+    
+    auto found = shapecache_index.find(key);
+    if(found != shapecache_index.end())
+    {
+        shapecache.splice(shapecache.begin(), shapecache, found->second);
+        return found->second->second;
+    }
+    
+    auto shaped = shape_text(text, size, myrenderer);
+    shapecache.emplace_front(key, shaped);
+    shapecache_index[key] = shapecache.begin();
+    if(shapecache.size() > shapecache_limit)
+    {
+        shapecache_index.erase(shapecache.back().first);
+        shapecache.pop_back();
+    }
+    return shaped;
+}
+
 struct subtitle
 {
     int initialized = false;
     float size;
     renderer * myrenderer;
+    // different for every subtitle made, so that replacing the current one is noticed as a change
+    uint64_t serial = ++subtitle_serials;
     
-    std::vector<hb_codepoint_t> glyphs;
-    std::vector<posdata> positions;
+    std::shared_ptr<const shapedtext> shaped;
     
     subtitle()
     {
@@ -1999,26 +3641,7 @@ struct subtitle
         this->size = size;
         this->myrenderer = myrenderer;
         
-        auto buffer = hb_buffer_create();
-        hb_buffer_add_utf8(buffer, text.data(), text.length(), 0, text.length());
-        hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
-        hb_buffer_set_script(buffer, HB_SCRIPT_COMMON);
-        hb_buffer_set_language(buffer, hb_language_get_default());
-        
-        unsigned int glyph_count;
-        hb_shape(hbfont, buffer, NULL, 0);
-        hb_glyph_info_t *     glyph_info = hb_buffer_get_glyph_infos    (buffer, &glyph_count);
-        hb_glyph_position_t * glyph_pos  = hb_buffer_get_glyph_positions(buffer, &glyph_count);
-        
-        for(unsigned int i = 0; i < glyph_count; ++i)
-        {
-            if(textcache.count(glyph_info[i].codepoint) == 0)
-                textcache[glyph_info[i].codepoint] = new glyph(glyph_info[i], glyph_pos[i], size, myrenderer);
-            glyphs.push_back(glyph_info[i].codepoint);
-            positions.push_back(posdata(glyph_info[i], glyph_pos[i], *textcache[glyph_info[i].codepoint]));
-        }
-        
-        hb_buffer_destroy(buffer);
+        shaped = cached_shape_text(text, size, myrenderer);
         
         initialized = true;
     }
@@ -2034,6 +3657,7 @@ struct region
     int xskew = 0;
     int skewmode = 1;
     float gamma = 1;
+    uint64_t pending = 0; // id of the OCR job that's going to fill in the text, if any
 };
 
 int textscale = 32; // most OCR software works best at a particular pixel size per character. for the OCR setup I have, it's 32 pixels. This will be an option later.
@@ -2049,15 +3673,161 @@ std::vector<region> regions;
 
 region * currentregion = 0;
 
+// a text block found on a page by find_text_blocks(), shown as a proposed region until it's clicked on; never saved
+struct textblock {
+    int x1, y1, x2, y2;
+    int mode; // 0 for vertical text, 1 for horizontal; not an OCR script like region::mode
+    int pixel_scale; // estimated size of a character
+    int lines;
+};
+std::vector<textblock> proposals; // for the current page
+
+// proposals that a region already covers most of aren't shown
+bool proposal_hidden(const textblock & b)
+{
+    float area = float(b.x2-b.x1)*(b.y2-b.y1);
+    for(const auto & r : regions)
+    {
+        float w = std::min(b.x2, std::max(r.x1, r.x2)) - std::max(b.x1, std::min(r.x1, r.x2));
+        float h = std::min(b.y2, std::max(r.y1, r.y2)) - std::max(b.y1, std::min(r.y1, r.y2));
+        if(w > 0 and h > 0 and w*h > area*0.3)
+            return true;
+    }
+    return false;
+}
+
 region tempregion = {0,0,0,0,"",0,0,0,0,0,1};
 
+// fingerprint of everything about the regions that gets drawn
+uint64_t regions_hash()
+{
+    uint64_t hash = fnv1a(nullptr, 0);
+    auto add = [&](const region & r)
+    {
+        int fields[] = {r.x1, r.y1, r.x2, r.y2, r.mode, r.pixel_scale, r.yskew, r.xskew, r.skewmode};
+        hash = fnv1a(fields, sizeof(fields), hash);
+        hash = fnv1a(&r.gamma, sizeof(r.gamma), hash);
+        hash = fnv1a(&r.pending, sizeof(r.pending), hash);
+        hash = fnv1a(r.text.data(), r.text.length(), hash);
+    };
+    for(const auto & r : regions)
+        add(r);
+    add(tempregion);
+    for(const auto & b : proposals)
+        hash = fnv1a(&b, sizeof(b), hash);
+    return hash;
+}
+
+// the four edges of the region's bounding box, two pixels thick regardless of zoom
+void add_box_outline(std::vector<outlineinstance> & outlines, const region & r, float red, float green, float blue, float alpha)
+{
+    const float noclip[4] = {-1e30f, -1e30f, 1e30f, 1e30f};
+    auto edge = [&](float x1, float y1, float x2, float y2, float ox1, float ox2, float oy1, float oy2)
+    {
+        outlineinstance o = {{x1, y1, x2, y1, x1, y2, x2, y2}, {ox1, ox2, oy1, oy2}, red, green, blue, alpha, {}};
+        memcpy(o.clip, noclip, sizeof(noclip));
+        outlines.push_back(o);
+    };
+    edge(r.x1, r.y1, r.x2, r.y1, -1, -1, -1, 1);
+    edge(r.x1, r.y1, r.x1, r.y2, -1, 1, 1, 1);
+    edge(r.x1, r.y2, r.x2, r.y2, 1, 1, -1, 1);
+    edge(r.x2, r.y1, r.x2, r.y2, -1, 1, -1, -1);
+}
+
+void add_region_outline(std::vector<outlineinstance> & outlines, const region & r)
+{
+    // regions waiting on OCR are orange
+    float red = r.pending ? 1.0 : 0.2;
+    float green = r.pending ? 0.6 : 0.8;
+    float blue = r.pending ? 0.1 : 1.0;
+    
+    if(r.yskew == 0 and r.xskew == 0)
+    {
+        add_box_outline(outlines, r, red, green, blue, 0.5);
+        return;
+    }
+    
+    double xlist1[4], ylist1[4], xlist2[4], ylist2[4];
+    
+    xlist1[0] = r.x1 - (r.x1+r.x2)/2.0;
+    xlist1[1] = r.x2 - (r.x1+r.x2)/2.0;
+    xlist1[2] = r.x1 - (r.x1+r.x2)/2.0;
+    xlist1[3] = r.x2 - (r.x1+r.x2)/2.0;
+    
+    ylist1[0] = r.y1 - (r.y1+r.y2)/2.0;
+    ylist1[1] = r.y1 - (r.y1+r.y2)/2.0;
+    ylist1[2] = r.y2 - (r.y1+r.y2)/2.0;
+    ylist1[3] = r.y2 - (r.y1+r.y2)/2.0;
+    
+    for(int i = 0; i < 4; i++)
+    {
+        auto x = xlist1[i];
+        auto y = ylist1[i];
+        auto ys = r.yskew*0.01;
+        auto xs = r.xskew*0.01;
+        xlist2[i] = x/(1-xs*ys) + y*xs/(xs*ys-1) + (r.x1+r.x2)/2.0;
+        ylist2[i] = x*ys/(xs*ys-1) + y/(1-xs*ys) + (r.y1+r.y2)/2.0;
+    }
+    if(r.skewmode == 1)
+    {
+        float minx = std::min(xlist2[0], xlist2[2]);
+        float miny = std::min(ylist2[0], ylist2[1]);
+        float xpad = fabs(minx-r.x1);
+        float ypad = fabs(miny-r.y1);
+        
+        xlist2[0] += xpad;
+        xlist2[2] += xpad;
+        xlist2[1] -= xpad;
+        xlist2[3] -= xpad;
+        
+        ylist2[0] += ypad;
+        ylist2[1] += ypad;
+        ylist2[2] -= ypad;
+        ylist2[3] -= ypad;
+    }
+    if(xlist2[1] >= xlist2[0] and ylist2[2] > ylist2[0])
+    {
+        // filled skewed quad, clipped to the region's box
+        outlineinstance o = {
+            {float(xlist2[0]), float(ylist2[0]), float(xlist2[1]), float(ylist2[1]), float(xlist2[2]), float(ylist2[2]), float(xlist2[3]), float(ylist2[3])},
+            {0, 0, 0, 0},
+            red, green, blue, 0.5,
+            {float(std::min(r.x1, r.x2)), float(std::min(r.y1, r.y2)), float(std::max(r.x1, r.x2)), float(std::max(r.y1, r.y2))}
+        };
+        outlines.push_back(o);
+    }
+    if(xlist2[1] < xlist2[0]+2 or ylist2[2] < ylist2[0]+2)
+        add_box_outline(outlines, r, 0.8, 0.2, 1.0, 0.5);
+}
+
+std::vector<outlineinstance> region_outlines()
+{
+    std::vector<outlineinstance> outlines;
+    outlines.reserve((regions.size()+proposals.size())*4+4);
+    for(const auto & r : regions)
+        add_region_outline(outlines, r);
+    add_region_outline(outlines, tempregion);
+    // proposed regions are a faint yellow-green
+    for(const auto & b : proposals)
+    {
+        region r;
+        r.x1 = b.x1;
+        r.y1 = b.y1;
+        r.x2 = b.x2;
+        r.y2 = b.y2;
+        if(!proposal_hidden(b))
+            add_box_outline(outlines, r, 0.7, 1.0, 0.2, 0.35);
+    }
+    return outlines;
+}
+
 void clear_current()
 {
     currentregion->text = "";
     currentsubtitle = subtitle();
 }
 
-void load_regions(std::string folder, std::string filename, int corewidth, int coreheight)
+void load_regions_into(std::vector<region> & regions, std::string folder, std::string filename, int corewidth, int coreheight)
 {
     puts("loading regions for");
     puts(folder.data());
@@ -2176,7 +3946,12 @@ void load_regions(std::string folder, std::string filename, int corewidth, int c
     fclose(f);
 }
 
-void write_regions(std::string folder, std::string filename, int width, int height)
+void load_regions(std::string folder, std::string filename, int corewidth, int coreheight)
+{
+    load_regions_into(regions, folder, filename, corewidth, coreheight);
+}
+
+void write_regions_from(const std::vector<region> & regions, std::string folder, std::string filename, int width, int height)
 {
     puts("writing regions for");
     puts(folder.data());
@@ -2247,30 +4022,43 @@ void write_regions(std::string folder, std::string filename, int width, int heig
     fclose(f);
 }
 
-// forward declare int ocr(){} from ocr.cpp
-int ocr(const char * filename, const char * commandfilename, const char * outfilename, const char * scale, const char * xshear, const char * yshear);
+void write_regions(std::string folder, std::string filename, int width, int height)
+{
+    write_regions_from(regions, folder, filename, width, height);
+}
 
-unsigned char * crop_copy(renderer::texture * tex, int x1, int y1, int x2, int y2, int * width, int * height, int yskew, int xskew, float exponent)
+// output has the same channel count as the page (1 for grayscale pages, 4 otherwise), or 1 if gray is set, written to *channels
+// the corners that shearing brings in from outside the region are white
+unsigned char * crop_copy(const unsigned char * pixels, int tw, int th, int n, int x1, int y1, int x2, int y2, int * width, int * height, int * channels, int yskew, int xskew, float exponent, bool gray)
 {
-    x1 = std::min(std::max(0, x1), tex->w-1);
-    x2 = std::min(std::max(0, x2), tex->w);
-    y1 = std::min(std::max(0, y1), tex->h-1);
-    y2 = std::min(std::max(0, y2), tex->h);
-    *width = x2-x1;
+    x1 = std::min(std::max(0, x1), tw-1);
+    x2 = std::min(std::max(0, x2), tw);
+    y1 = std::min(std::max(0, y1), th-1);
+    y2 = std::min(std::max(0, y2), th);
+    int w = x2-x1;
+    int outn = gray ? 1 : n;
+    *width = w;
     *height = y2-y1;
-    unsigned char * data = (unsigned char *)malloc(*width**height*4);
+    *channels = outn;
+    unsigned char * data = (unsigned char *)malloc(size_t(w)*(y2-y1)*outn);
     
-    int tw = tex->w;
-    
-    int i = 0;
+    unsigned char table[256];
+    bool identity = true;
+    for(int i = 0; i < 256; i++)
+    {
+        table[i] = round(pow(i/255.0f, exponent)*255.0f);
+        identity = identity and table[i] == i;
+    }
     
     auto xs = xskew*0.01;
     auto ys = yskew*0.01;
     
-    float cx1 = x1-(x1+x2)/2.0f;
-    float cx2 = x2-(x1+x2)/2.0f;
-    float cy1 = y1-(y1+y2)/2.0f;
-    float cy2 = y2-(y1+y2)/2.0f;
+    float cx = (x1+x2)/2.0f;
+    float cy = (y1+y2)/2.0f;
+    float cx1 = x1-cx;
+    float cx2 = x2-cx;
+    float cy1 = y1-cy;
+    float cy2 = y2-cy;
     
     float tx1 = cx1/(1-xs*ys) + cy1*xs/(xs*ys-1);
     float tx2 = cx1/(1-xs*ys) + cy2*xs/(xs*ys-1);
@@ -2284,53 +4072,938 @@ unsigned char * crop_copy(renderer::texture * tex, int x1, int y1, int x2, int y
     float xpad = fabs(minx-cx1);
     float ypad = fabs(miny-cy1);
     
+    auto inside = [&](int x, int y)
+    {
+        float skx = (x-cx) + xs*(y-cy) + cx;
+        float sky = (y-cy) + ys*(x-cx) + cy;
+        return !(skx < x1+xpad or skx > x2-xpad or sky < y1+ypad or sky > y2-ypad);
+    };
+    
     for(int y = y1; y < y2; y++)
     {
-        for(int x = x1; x < x2; x++)
+        // a pixel is kept if its sheared position (x + xs*(y-cy), y + ys*(x-cx)) is inside the padded region
+        // both are linear in x, so that's a single span per row
+        double dy = y-cy;
+        double low = x1+xpad - xs*dy;
+        double high = x2-xpad - xs*dy;
+        if(ys != 0)
+        {
+            double top = cx + (y1+ypad - y)/ys;
+            double bottom = cx + (y2-ypad - y)/ys;
+            if(ys < 0)
+                std::swap(top, bottom);
+            low = std::max(low, top);
+            high = std::min(high, bottom);
+        }
+        else if(y < y1+ypad or y > y2-ypad)
+            high = low-1;
+        int first = std::min(x2, std::max(x1, int(ceil(low))));
+        int last = std::max(first, std::min(x2, int(floor(high))+1));
+        // rounding can put the ends of the span a pixel off from where the per-pixel test puts them
+        while(first > x1 and inside(first-1, y))
+            first--;
+        while(first < last and !inside(first, y))
+            first++;
+        while(last < x2 and inside(last, y))
+            last++;
+        while(last > first and !inside(last-1, y))
+            last--;
+        
+        unsigned char * out = data + size_t(y-y1)*w*outn;
+        memset(out, 0xFF, size_t(first-x1)*outn);
+        memset(out + size_t(last-x1)*outn, 0xFF, size_t(x2-last)*outn);
+        out += size_t(first-x1)*outn;
+        const unsigned char * in = pixels + (size_t(y)*tw + first)*n;
+        int count = last-first;
+        
+        if(outn == n)
+            memcpy(out, in, size_t(count)*n);
+        else if(n >= 3)
         {
-            for(int c = 0; c < 4; c++)
+            // rec. 709 luma, in 8-bit fixed point
+            int x = 0;
+            #ifdef __SSE2__
+            if(n == 4)
             {
-                data[i] = tex->mydata[(y*tw + x)*4 + c];
-                
-                float temp = data[i]/255.0f;
-                temp = pow(temp, exponent);
-                data[i] = round(temp*255.0f);
-                
-                float tempx = x-(x1+x2)/2.0f;
-                float tempy = y-(y1+y2)/2.0f;
-                float skx = tempx + xs*tempy + (x1+x2)/2.0f;
-                float sky = tempy + ys*tempx + (y1+y2)/2.0f;
-                
-                if(skx < x1+xpad or skx > x2-xpad or sky < y1+ypad or sky > y2-ypad)
-                    data[i] = 0xFF;
-                i++;
+                const __m128i weights = _mm_setr_epi16(54, 183, 19, 0, 54, 183, 19, 0);
+                const __m128i zero = _mm_setzero_si128();
+                for(; x+4 <= count; x += 4)
+                {
+                    __m128i rgba = _mm_loadu_si128((const __m128i *)(in + x*4));
+                    // each pixel ends up as two partial sums, r+g and b+a
+                    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(rgba, zero), weights);
+                    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(rgba, zero), weights);
+                    lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+                    hi = _mm_add_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+                    __m128i sums = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+                    sums = _mm_srli_epi32(_mm_add_epi32(sums, _mm_set1_epi32(128)), 8);
+                    sums = _mm_packs_epi32(sums, sums);
+                    sums = _mm_packus_epi16(sums, sums);
+                    int four = _mm_cvtsi128_si32(sums);
+                    memcpy(out + x, &four, 4);
+                }
+            }
+            #endif
+            for(; x < count; x++)
+            {
+                const unsigned char * c = in + x*n;
+                out[x] = (c[0]*54 + c[1]*183 + c[2]*19 + 128) >> 8;
             }
         }
+        else
+        {
+            for(int x = 0; x < count; x++)
+                out[x] = in[x*n];
+        }
+        
+        if(!identity)
+        {
+            for(int i = 0; i < count*outn; i++)
+                out[i] = table[out[i]];
+        }
     }
     return data;
 }
+unsigned char * crop_copy(renderer::texture * tex, int x1, int y1, int x2, int y2, int * width, int * height, int * channels, int yskew, int xskew, float exponent, bool gray)
+{
+    return crop_copy(tex->mydata, tex->w, tex->h, tex->n, x1, y1, x2, y2, width, height, channels, yskew, xskew, exponent, gray);
+}
+
+// native OCR preprocessing, for ocr_preprocess: the same steps as the windows example script in the readme, without running imagemagick
+// works on float grayscale, 0 to 1
+struct ocrplane {
+    int w = 0, h = 0;
+    std::vector<float> data;
+    ocrplane() { }
+    ocrplane(int w, int h, float value = 0) : w(w), h(h), data(size_t(w)*h, value) { }
+};
+
+// weights for every quantized sub-pixel phase, like the renderer's jinc weight table
+// rows are padded out to a multiple of 4 taps with zero weights, so they can be summed 4 at a time
+struct ocrkernel {
+    int taps, first, stride;
+    std::vector<float> weights; // 256 phases of taps rows of stride weights
+    float * phase(int qx, int qy) { return &weights[size_t(qy*16 + qx)*taps*stride]; }
+};
 
-int estimate_width(unsigned char * data, int width, int height)
+// catmull-rom, the same hermite spline the image shader upscales with
+static void ocr_hermite_weights(float t, float * w)
 {
-    int first_low_saturation = -1;
-    int last_low_saturation = -1;
-    int first_high_saturation = -1;
-    int last_high_saturation = -1;
-    float typical_saturation = 0;
-    float typical_saturation_normalize = 0;
-    
-    for(int y = 10; y < height-10; y++)
+    float h00 = t*t*t*2 - t*t*3 + 1;
+    float h10 = t*t*t - t*t*2 + t;
+    float h01 = -t*t*t*2 + t*t*3;
+    float h11 = t*t*t - t*t;
+    w[0] = -h10/2;
+    w[1] = h00 - h11/2;
+    w[2] = h01 + h10/2;
+    w[3] = h11/2;
+}
+static ocrkernel ocr_hermite_kernel()
+{
+    ocrkernel k;
+    k.taps = 4;
+    k.first = -1;
+    k.stride = 4;
+    k.weights.resize(256*16);
+    for(int qy = 0; qy < 16; qy++)
     {
-        for(int x = 3; x < width-3; x++)
+        for(int qx = 0; qx < 16; qx++)
         {
-            float saturation = 0;
-            for(int c = 0; c < 3; c++)
-            {
-                saturation += data[(y*width + x)*4 + c];
-            }
-            saturation /= (256*3);
-            if(x < 10 or x > width-10 or y < 23 or y > height-23)
-            {
+            float wx[4], wy[4];
+            ocr_hermite_weights(qx/16.0f, wx);
+            ocr_hermite_weights(qy/16.0f, wy);
+            float * row = k.phase(qx, qy);
+            for(int j = 0; j < 4; j++)
+                for(int i = 0; i < 4; i++)
+                    row[j*4 + i] = wx[i]*wy[j];
+        }
+    }
+    return k;
+}
+// windowed jinc for downscaling by scale (less than 1), with radius in output pixels
+static ocrkernel ocr_jinc_kernel(float scale, float radius)
+{
+    ocrkernel k;
+    int reach = int(ceil(radius/scale));
+    k.taps = reach*2 + 2;
+    k.first = 1 - k.taps/2;
+    k.stride = (k.taps + 3) & ~3;
+    k.weights.resize(size_t(256)*k.taps*k.stride);
+    for(int qy = 0; qy < 16; qy++)
+    {
+        for(int qx = 0; qx < 16; qx++)
+        {
+            float * row = k.phase(qx, qy);
+            double sum = 0;
+            for(int j = 0; j < k.taps; j++)
+            {
+                for(int i = 0; i < k.taps; i++)
+                {
+                    double dx = k.first + i - qx/16.0;
+                    double dy = k.first + j - qy/16.0;
+                    double weight = jinc_window(scale*sqrt(dx*dx + dy*dy), radius);
+                    row[j*k.stride + i] = weight;
+                    sum += weight;
+                }
+            }
+            for(int j = 0; j < k.taps; j++)
+                for(int i = 0; i < k.taps; i++)
+                    row[j*k.stride + i] /= sum;
+        }
+    }
+    return k;
+}
+
+// sum of a*b over len floats, len a multiple of 4
+static inline float ocr_dot(const float * a, const float * b, int len)
+{
+    #ifdef __SSE2__
+    __m128 sum = _mm_setzero_ps();
+    for(int i = 0; i < len; i += 4)
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    #else
+    float sum = 0;
+    for(int i = 0; i < len; i++)
+        sum += a[i]*b[i];
+    return sum;
+    #endif
+}
+
+// output pixel (u, v) samples the source at (a*u + b*v + c, d*u + e*v + f), in pixel center coordinates
+// outside the source is the nearest edge pixel if border is negative, or border otherwise
+static ocrplane ocr_resample(const ocrplane & src, int w, int h, ocrkernel & k, float a, float b, float c, float d, float e, float f, float border)
+{
+    // padded so that every tap of a sample near the edge can be read without checking
+    int pad = k.stride + 2;
+    int pw = src.w + pad*2;
+    int ph = src.h + pad*2;
+    std::vector<float> padded(size_t(pw)*ph);
+    for(int y = 0; y < ph; y++)
+    {
+        int sy = std::min(std::max(y-pad, 0), src.h-1);
+        bool inside_y = y-pad == sy;
+        for(int x = 0; x < pw; x++)
+        {
+            int sx = std::min(std::max(x-pad, 0), src.w-1);
+            if(border >= 0 and (!inside_y or x-pad != sx))
+                padded[size_t(y)*pw + x] = border;
+            else
+                padded[size_t(y)*pw + x] = src.data[size_t(sy)*src.w + sx];
+        }
+    }
+    
+    ocrplane out(w, h);
+    for(int v = 0; v < h; v++)
+    {
+        for(int u = 0; u < w; u++)
+        {
+            float sx = a*u + b*v + c;
+            float sy = d*u + e*v + f;
+            int bx = int(floor(sx));
+            int by = int(floor(sy));
+            int qx = int(floor((sx-bx)*16 + 0.5f));
+            int qy = int(floor((sy-by)*16 + 0.5f));
+            if(qx == 16) { qx = 0; bx += 1; }
+            if(qy == 16) { qy = 0; by += 1; }
+            
+            int left = bx + k.first + pad;
+            int top = by + k.first + pad;
+            if(left < 0 or top < 0 or left + k.stride > pw or top + k.taps > ph)
+            {
+                if(border >= 0)
+                {
+                    out.data[size_t(v)*w + u] = border;
+                    continue;
+                }
+                left = std::min(std::max(left, 0), pw - k.stride);
+                top = std::min(std::max(top, 0), ph - k.taps);
+            }
+            
+            const float * weights = k.phase(qx, qy);
+            float sum = 0;
+            for(int j = 0; j < k.taps; j++)
+                sum += ocr_dot(&padded[size_t(top+j)*pw + left], weights + j*k.stride, k.stride);
+            out.data[size_t(v)*w + u] = sum;
+        }
+    }
+    return out;
+}
+
+static ocrplane ocr_resize(const ocrplane & src, int w, int h)
+{
+    float sx = src.w/float(w);
+    float sy = src.h/float(h);
+    float scale = std::min(w/float(src.w), h/float(src.h));
+    // downscaling uses jinc as wide as the axis that shrinks the most needs, upscaling uses hermite
+    ocrkernel k = scale < 1 ? ocr_jinc_kernel(scale, 2) : ocr_hermite_kernel();
+    return ocr_resample(src, w, h, k, sx, 0, 0.5f*sx - 0.5f, 0, sy, 0.5f*sy - 0.5f, -1);
+}
+
+// imagemagick's -virtual-pixel white -distort AffineProjection 1,$YSHEAR,$XSHEAR,1,%[fx:h/2*-$XSHEAR],%[fx:w/2*-$YSHEAR]
+static ocrplane ocr_shear(const ocrplane & src, float xshear, float yshear)
+{
+    float det = 1 - xshear*yshear;
+    if((xshear == 0 and yshear == 0) or fabs(det) < 0.01)
+        return src;
+    // inverse of u = x + xshear*(y - h/2), v = y + yshear*(x - w/2), with pixel centers at +0.5
+    float cu = 0.5f + xshear*src.h/2;
+    float cv = 0.5f + yshear*src.w/2;
+    ocrkernel k = ocr_hermite_kernel();
+    return ocr_resample(src, src.w, src.h, k,
+        1/det, -xshear/det, (cu - xshear*cv)/det - 0.5f,
+        -yshear/det, 1/det, (cv - yshear*cu)/det - 0.5f,
+        1);
+}
+
+// imagemagick's -auto-level
+static void ocr_autolevel(ocrplane & p)
+{
+    if(p.data.size() == 0)
+        return;
+    auto range = std::minmax_element(p.data.begin(), p.data.end());
+    float low = *range.first;
+    float high = *range.second;
+    if(high - low < 1/255.0f)
+        return;
+    for(auto & value : p.data)
+        value = (value-low)/(high-low);
+}
+
+// imagemagick's -sigmoidal-contrast <contrast>x<midpoint>, through a table
+static void ocr_sigmoidal(ocrplane & p, float contrast, float midpoint)
+{
+    const int size = 4096;
+    float table[size+1];
+    auto sigmoid = [&](double x) { return 1/(1+exp(contrast*(midpoint-x))); };
+    double low = sigmoid(0);
+    double high = sigmoid(1);
+    for(int i = 0; i <= size; i++)
+        table[i] = (sigmoid(i/double(size)) - low)/(high - low);
+    for(auto & value : p.data)
+        value = table[int(std::min(std::max(value, 0.0f), 1.0f)*size + 0.5f)];
+}
+
+static ocrplane ocr_blur(const ocrplane & src, float sigma)
+{
+    int radius = int(ceil(sigma*3));
+    int taps = radius*2 + 1;
+    std::vector<float> kernel(taps);
+    float sum = 0;
+    for(int i = 0; i < taps; i++)
+    {
+        kernel[i] = exp(-(i-radius)*(i-radius)/(2*sigma*sigma));
+        sum += kernel[i];
+    }
+    for(auto & weight : kernel)
+        weight /= sum;
+    
+    // horizontal pass, over a copy of the row that's extended by its edge pixels
+    ocrplane across(src.w, src.h);
+    std::vector<float> row(src.w + radius*2);
+    for(int y = 0; y < src.h; y++)
+    {
+        const float * in = &src.data[size_t(y)*src.w];
+        for(int x = 0; x < int(row.size()); x++)
+            row[x] = in[std::min(std::max(x-radius, 0), src.w-1)];
+        float * out = &across.data[size_t(y)*src.w];
+        int x = 0;
+        #ifdef __SSE2__
+        for(; x+4 <= src.w; x += 4)
+        {
+            __m128 acc = _mm_setzero_ps();
+            for(int i = 0; i < taps; i++)
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(kernel[i]), _mm_loadu_ps(&row[x+i])));
+            _mm_storeu_ps(out+x, acc);
+        }
+        #endif
+        for(; x < src.w; x++)
+        {
+            float acc = 0;
+            for(int i = 0; i < taps; i++)
+                acc += kernel[i]*row[x+i];
+            out[x] = acc;
+        }
+    }
+    
+    // vertical pass, a row at a time
+    ocrplane out(src.w, src.h);
+    for(int y = 0; y < src.h; y++)
+    {
+        float * dst = &out.data[size_t(y)*src.w];
+        for(int i = 0; i < taps; i++)
+        {
+            const float * in = &across.data[size_t(std::min(std::max(y+i-radius, 0), src.h-1))*src.w];
+            float weight = kernel[i];
+            int x = 0;
+            #ifdef __SSE2__
+            __m128 w4 = _mm_set1_ps(weight);
+            for(; x+4 <= src.w; x += 4)
+                _mm_storeu_ps(dst+x, _mm_add_ps(_mm_loadu_ps(dst+x), _mm_mul_ps(w4, _mm_loadu_ps(in+x))));
+            #endif
+            for(; x < src.w; x++)
+                dst[x] += weight*in[x];
+        }
+    }
+    return out;
+}
+
+// imagemagick's -unsharp 0x<sigma>, with its default amount (1) and threshold (0.05)
+static void ocr_unsharp(ocrplane & p, float sigma)
+{
+    auto blurred = ocr_blur(p, sigma);
+    for(size_t i = 0; i < p.data.size(); i++)
+    {
+        float difference = p.data[i] - blurred.data[i];
+        if(fabs(2*difference) >= 0.05f)
+            p.data[i] += difference;
+    }
+}
+
+// prepares a crop for OCR: grayscale, auto-level, resize to scale, shear, sigmoidal contrast, unsharp, then halve
+// scale and the shears are what $SCALE, $XSHEAR and $YSHEAR would be; returns an 8-bit grayscale image
+unsigned char * preprocess_for_ocr(const unsigned char * pixels, int w, int h, int n, float scale, float xshear, float yshear, int * width, int * height)
+{
+    ocrplane p(w, h);
+    for(size_t i = 0; i < size_t(w)*h; i++)
+    {
+        const unsigned char * c = pixels + i*n;
+        // alpha is ignored, like -alpha off
+        if(n >= 3)
+            p.data[i] = (c[0]*0.2126f + c[1]*0.7152f + c[2]*0.0722f)/255.0f;
+        else
+            p.data[i] = c[0]/255.0f;
+    }
+    
+    ocr_autolevel(p);
+    
+    int rw = std::max(1, int(round(w*scale)));
+    int rh = std::max(1, int(round(h*scale)));
+    if(rw != w or rh != h)
+        p = ocr_resize(p, rw, rh);
+    
+    p = ocr_shear(p, xshear, yshear);
+    ocr_sigmoidal(p, 5, 0.5);
+    ocr_unsharp(p, 3);
+    
+    // the example script works at double size and halves at the end ($SCALE already has the doubling in it)
+    p = ocr_resize(p, std::max(1, (p.w+1)/2), std::max(1, (p.h+1)/2));
+    
+    *width = p.w;
+    *height = p.h;
+    unsigned char * out = (unsigned char *)malloc(p.data.size());
+    for(size_t i = 0; i < p.data.size(); i++)
+        out[i] = std::min(std::max(int(round(p.data[i]*255)), 0), 255);
+    return out;
+}
+
+// the command script for each OCR mode
+std::string ocr_command_file(int mode)
+{
+    if(mode == 1)
+        return profile()+"ocr2.txt";
+    else if(mode == 2)
+        return profile()+"ocr3.txt";
+    else if(mode == 3)
+        return profile()+"ocr4.txt";
+    else if(mode == 4)
+        return profile()+"ocr5.txt";
+    else if(mode == 5)
+        return profile()+"ocr6.txt";
+    else
+        return profile()+"ocr.txt";
+}
+
+// runs OCR commands on worker threads; the main thread owns the regions, so results are handed back to it to fill in
+struct ocrqueue {
+    struct job {
+        uint64_t id = 0;
+        // which page's region file the region is in, and the region itself
+        std::string folder, filename;
+        int page_w, page_h;
+        int x1, y1, x2, y2;
+        // cropped image, owned by the job until it's written out
+        unsigned char * data = nullptr;
+        int w, h, n;
+        std::string tempdir, commandfile, scale, xshear, yshear;
+        double timeout = 0; // seconds, 0 for no limit
+        bool preprocess = false; // prepare the image natively instead of leaving it to the script
+        bool speculative = false; // nobody asked for it yet, so it runs only when no clicked region is waiting
+        // set to stop the job, whether it's still queued or already running
+        std::shared_ptr<std::atomic<bool>> cancel = std::make_shared<std::atomic<bool>>(false);
+        // result
+        std::string text;
+        bool ok = false;
+        // for putting the result in the OCR cache
+        hash128 cachekey;
+    };
+    std::mutex mutex;
+    std::condition_variable wakeup; // for workers: new jobs or quitting
+    std::condition_variable finished; // for wait_results(): a job finished
+    std::deque<job> queue;
+    std::deque<job> background; // speculative jobs, only taken when queue is empty
+    std::vector<job> done;
+    std::vector<std::thread> workers;
+    int busy = 0;
+    std::map<uint64_t, std::shared_ptr<std::atomic<bool>>> running_speculative;
+    bool quitting = false;
+    bool wake_window; // false when there's no window, like in batch mode
+    
+    // only touched by the main thread
+    uint64_t nextid = 0;
+    std::map<uint64_t, job> submitted; // without the image data
+    std::set<uint64_t> preempted; // speculative jobs stopped to free up a worker, to be queued again when they come back
+    std::set<uint64_t> promoted; // speculative jobs that were clicked on while running or preempted, never to be preempted again
+    
+    ocrqueue(int threads, bool wake_window = true)
+    {
+        this->wake_window = wake_window;
+        if(threads < 1) threads = 1;
+        for(int i = 0; i < threads; i++)
+            workers.push_back(std::thread([this](){ work(); }));
+    }
+    ~ocrqueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+            for(auto & j : queue)
+                free(j.data);
+            for(auto & j : background)
+                free(j.data);
+            for(auto & j : done)
+                free(j.data);
+            queue.clear();
+            background.clear();
+            done.clear();
+        }
+        wakeup.notify_all();
+        // stops commands that are already running instead of waiting for them
+        for(auto & pair : submitted)
+            pair.second.cancel->store(true);
+        for(auto & thread : workers)
+            thread.join();
+    }
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wakeup.wait(lock, [this](){ return quitting or queue.size() > 0 or background.size() > 0; });
+            if(quitting) return;
+            
+            auto & from = queue.size() > 0 ? queue : background;
+            job j = from.front();
+            from.pop_front();
+            busy++;
+            if(j.speculative)
+                running_speculative[j.id] = j.cancel;
+            
+            lock.unlock();
+            run(j);
+            lock.lock();
+            
+            busy--;
+            running_speculative.erase(j.id);
+            // preempt() can't pick it anymore, so whether it was stopped is settled now
+            // a stopped speculative job keeps its image in case it was only preempted and has to run again
+            if(!(j.speculative and j.cancel->load()))
+            {
+                free(j.data);
+                j.data = nullptr;
+            }
+            done.push_back(j);
+            finished.notify_all();
+            if(wake_window)
+                glfwPostEmptyEvent();
+        }
+    }
+    // leaves freeing the image to work()
+    static void run(job & j)
+    {
+        if(j.cancel->load())
+            return;
+        
+        if(j.preprocess)
+        {
+            int w, h;
+            auto prepared = preprocess_for_ocr(j.data, j.w, j.h, j.n, atof(j.scale.data())/100, atof(j.xshear.data()), atof(j.yshear.data()), &w, &h);
+            free(j.data);
+            j.data = prepared;
+            j.w = w;
+            j.h = h;
+            j.n = 1;
+            // already done, so the script shouldn't do it again (nor this, if the job runs again)
+            j.preprocess = false;
+            j.scale = "100";
+            j.xshear = "0";
+            j.yshear = "0";
+        }
+        
+        ocrlimits limits;
+        limits.timeout = j.timeout;
+        limits.cancel = j.cancel.get();
+        
+        std::vector<unsigned char> png;
+        stbi_write_png_to_func([](void * context, void * data, int size){
+            auto png = (std::vector<unsigned char> *)context;
+            png->insert(png->end(), (unsigned char *)data, (unsigned char *)data + size);
+        }, &png, j.w, j.h, j.n, j.data, j.w*j.n);
+        
+        std::string output;
+        if(!ocr_wants_files(j.commandfile.data()))
+        {
+            j.ok = ocr_piped(j.commandfile.data(), png.data(), png.size(), &output, j.scale.data(), j.xshear.data(), j.yshear.data(), limits) == 0;
+        }
+        else
+        {
+            // unique to this process and job, so that several jobs (and several copies of nezuyomi) can run at once
+            auto unique = std::to_string(getpid()) + "_" + std::to_string(j.id);
+            auto imagefile = j.tempdir + "temp_ocr_" + unique + ".png";
+            auto textfile = j.tempdir + "temp_text_" + unique + ".txt";
+            
+            auto f = wrap_fopen(imagefile.data(), "wb");
+            if(!f)
+            {
+                puts("couldn't write cropped image to disk");
+                puts(imagefile.data());
+                return;
+            }
+            fwrite(png.data(), 1, png.size(), f);
+            fclose(f);
+            
+            auto status = ocr(imagefile.data(), j.commandfile.data(), textfile.data(), j.scale.data(), j.xshear.data(), j.yshear.data(), limits);
+            
+            // a stopped script may have left a partial text file behind
+            auto f2 = status == 0 ? wrap_fopen(textfile.data(), "rb") : nullptr;
+            if(f2)
+            {
+                fseek(f2, 0, SEEK_END);
+                size_t len = ftell(f2);
+                fseek(f2, 0, SEEK_SET);
+                
+                output = std::string(len, 0);
+                output.resize(fread(&output[0], 1, len, f2));
+                j.ok = true;
+                fclose(f2);
+            }
+            
+            wrap_remove(imagefile.data());
+            wrap_remove(textfile.data());
+        }
+        
+        // some OCR programs output formfeed characters when invoked by nezuyomi for some reason
+        for(char c : output)
+            if (c != 0x0C and c != '\r')
+                j.text += c;
+    }
+    // takes ownership of the job's image data and returns the job's id
+    uint64_t submit(job j)
+    {
+        j.id = ++nextid;
+        
+        job record = j;
+        record.data = nullptr;
+        submitted[j.id] = record;
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(j.speculative)
+                background.push_back(j);
+            else
+            {
+                queue.push_back(j);
+                if(busy == int(workers.size()))
+                    preempt();
+            }
+        }
+        wakeup.notify_one();
+        return j.id;
+    }
+    // stops one running speculative job so that a clicked region doesn't have to wait for it; needs the lock held
+    void preempt()
+    {
+        for(const auto & pair : running_speculative)
+        {
+            if(preempted.count(pair.first) or promoted.count(pair.first) or pair.second->load())
+                continue;
+            preempted.insert(pair.first);
+            pair.second->store(true);
+            return;
+        }
+    }
+    // a region that was clicked on has a speculative job
+    // one that hasn't started yet moves to the front lane; one that's running or preempted gets there when it comes back
+    void promote(uint64_t id)
+    {
+        if(submitted.count(id) == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto it = background.begin(); it != background.end(); it++)
+        {
+            if(it->id != id)
+                continue;
+            auto j = *it;
+            background.erase(it);
+            j.speculative = false;
+            queue.push_back(j);
+            if(busy == int(workers.size()))
+                preempt();
+            wakeup.notify_one();
+            return;
+        }
+        promoted.insert(id);
+    }
+    // stops a job that hasn't finished yet; its result still comes back, failed, through take_results()
+    void cancel(uint64_t id)
+    {
+        preempted.erase(id);
+        promoted.erase(id);
+        if(submitted.count(id))
+            submitted[id].cancel->store(true);
+    }
+    std::vector<job> take_results()
+    {
+        std::vector<job> results;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            results.swap(done);
+        }
+        std::vector<job> finished_jobs;
+        for(auto & j : results)
+        {
+            if(preempted.count(j.id))
+            {
+                preempted.erase(j.id);
+                if(!j.ok and j.data)
+                {
+                    // same id, so that regions marked as pending on it stay that way
+                    j.text = "";
+                    j.cancel = std::make_shared<std::atomic<bool>>(false);
+                    submitted[j.id].cancel = j.cancel;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if(promoted.count(j.id))
+                    {
+                        promoted.erase(j.id);
+                        j.speculative = false;
+                        queue.push_back(j);
+                        if(busy == int(workers.size()))
+                            preempt();
+                    }
+                    else
+                        background.push_front(j);
+                    wakeup.notify_one();
+                    continue;
+                }
+                // it finished before it could be stopped, so its result counts
+                j.cancel->store(false);
+            }
+            free(j.data);
+            j.data = nullptr;
+            submitted.erase(j.id);
+            promoted.erase(j.id);
+            finished_jobs.push_back(j);
+        }
+        return finished_jobs;
+    }
+    // blocks until at least one job has finished, unless nothing is in flight
+    std::vector<job> wait_results()
+    {
+        if(submitted.size() == 0)
+            return {};
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this](){ return done.size() > 0; });
+        }
+        return take_results();
+    }
+    // for regions that were just loaded from disk while OCR for them is still running
+    void mark_pending(std::vector<region> & regions, const std::string & folder, const std::string & filename)
+    {
+        for(const auto & pair : submitted)
+        {
+            const auto & j = pair.second;
+            if(j.folder != folder or j.filename != filename)
+                continue;
+            for(auto & r : regions)
+                if(r.x1 == j.x1 and r.y1 == j.y1 and r.x2 == j.x2 and r.y2 == j.y2 and r.text == "")
+                    r.pending = j.id;
+        }
+    }
+};
+
+// OCR results by content, shared by every folder: PROFILE/ocrcache.bin is only ever appended to, and indexed in memory when it's opened
+// keyed on the cropped pixels, the OCR script, and what gets passed to it, so that changing any of those misses
+struct ocrcache {
+    struct record {
+        char magic[4];
+        uint32_t textlength; // text follows the record
+        uint64_t key[2];
+    };
+    struct location {
+        uint64_t offset;
+        uint32_t length;
+    };
+    std::map<hash128, location> index;
+    FILE * file = nullptr;
+    std::string path;
+    uint64_t hits = 0, misses = 0;
+    
+    ~ocrcache()
+    {
+        if(file)
+            fclose(file);
+    }
+    void open(const std::string & path)
+    {
+        this->path = path;
+        file = wrap_fopen(path.data(), "a+b");
+        if(!file)
+        {
+            puts("couldn't open OCR cache");
+            puts(path.data());
+            return;
+        }
+        
+        fseek(file, 0, SEEK_END);
+        uint64_t size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        
+        uint64_t offset = 0;
+        record r;
+        while(offset + sizeof(record) <= size and fread(&r, sizeof(record), 1, file) == 1)
+        {
+            if(memcmp(r.magic, "NZOC", 4) != 0 or offset + sizeof(record) + r.textlength > size)
+                break;
+            hash128 key;
+            key.a = r.key[0];
+            key.b = r.key[1];
+            index[key] = {offset + sizeof(record), r.textlength};
+            offset += sizeof(record) + r.textlength;
+            fseek(file, offset, SEEK_SET);
+        }
+        printf("loaded %d OCR cache entries\n", int(index.size()));
+        fclose(file);
+        
+        // a record cut off by a crash would throw off everything appended after it
+        // cut in place rather than replaced, so that other copies of nezuyomi appending to it keep appending to the same file
+        if(offset != size)
+        {
+            puts("OCR cache has a damaged tail, cutting it off");
+            if(!wrap_truncate(path.data(), offset))
+            {
+                puts("couldn't repair OCR cache, not using it");
+                file = nullptr;
+                index.clear();
+                return;
+            }
+        }
+        
+        // unbuffered, so that each record goes out in a single write; in append mode, that keeps records
+        // from other copies of nezuyomi appending at the same time from interleaving with it
+        file = wrap_fopen(path.data(), "a+b");
+        if(file)
+            setvbuf(file, nullptr, _IONBF, 0);
+        else
+            index.clear();
+    }
+    static std::string script_contents(const std::string & commandfile)
+    {
+        std::string contents;
+        auto f = wrap_fopen(commandfile.data(), "rb");
+        if(!f)
+            return contents;
+        char buffer[4096];
+        while(size_t got = fread(buffer, 1, sizeof(buffer), f))
+            contents.append(buffer, got);
+        fclose(f);
+        return contents;
+    }
+    static hash128 make_key(const ocrqueue::job & job, float gamma)
+    {
+        hash128 key;
+        int dimensions[] = {job.w, job.h, job.n};
+        key.add(dimensions, sizeof(dimensions));
+        key.add(job.data, size_t(job.w)*job.h*job.n);
+        key.add(script_contents(job.commandfile));
+        key.add(job.scale);
+        key.add(job.xshear);
+        key.add(job.yshear);
+        key.add(&gamma, sizeof(gamma));
+        if(job.preprocess)
+            key.add(std::string("preprocessed"));
+        return key;
+    }
+    bool get(const hash128 & key, std::string & text)
+    {
+        auto found = index.find(key);
+        if(!file or found == index.end())
+        {
+            misses++;
+            return false;
+        }
+        text = std::string(found->second.length, 0);
+        fseek(file, found->second.offset, SEEK_SET);
+        if(found->second.length > 0 and fread(&text[0], found->second.length, 1, file) != 1)
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        printf("OCR cache hit (%d hits, %d misses)\n", int(hits), int(misses));
+        return true;
+    }
+    void put(const hash128 & key, const std::string & text)
+    {
+        if(!file or index.count(key) > 0)
+            return;
+        record r;
+        memcpy(r.magic, "NZOC", 4);
+        r.textlength = text.length();
+        r.key[0] = key.a;
+        r.key[1] = key.b;
+        
+        // one write per record, see open()
+        std::string bytes((const char *)&r, sizeof(r));
+        bytes += text;
+        if(fwrite(bytes.data(), 1, bytes.length(), file) != bytes.length())
+            return;
+        // the file is in append mode, so the record landed at the end, wherever that was at the time
+        uint64_t offset = ftell(file) - bytes.length();
+        index[key] = {offset + sizeof(record), r.textlength};
+    }
+};
+
+ocrcache ocrresults;
+
+int estimate_width(unsigned char * data, int width, int height, int channels)
+{
+    int first_low_saturation = -1;
+    int last_low_saturation = -1;
+    int first_high_saturation = -1;
+    int last_high_saturation = -1;
+    float typical_saturation = 0;
+    float typical_saturation_normalize = 0;
+    
+    for(int y = 10; y < height-10; y++)
+    {
+        for(int x = 3; x < width-3; x++)
+        {
+            float saturation = 0;
+            if(channels == 1)
+                saturation = data[y*width + x]/256.0;
+            else
+            {
+                for(int c = 0; c < 3; c++)
+                {
+                    saturation += data[(y*width + x)*channels + c];
+                }
+                saturation /= (256*3);
+            }
+            if(x < 10 or x > width-10 or y < 23 or y > height-23)
+            {
                 typical_saturation += saturation;
                 typical_saturation_normalize += 1;
             }
@@ -2359,6 +5032,403 @@ int estimate_width(unsigned char * data, int width, int height)
     }
 }
 
+// finds blocks of text on a page, for proposing regions: binarizes the page, finds connected components that are the right size to be
+// (parts of) characters, groups ones that are close together, and works out the lines of each group from its projection profiles
+std::vector<textblock> find_text_blocks(const unsigned char * pixels, int w, int h, int n)
+{
+    std::vector<textblock> blocks;
+    if(!pixels or w < 16 or h < 16)
+        return blocks;
+    size_t count = size_t(w)*h;
+    
+    std::vector<unsigned char> gray(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        const unsigned char * c = pixels + i*n;
+        gray[i] = n >= 3 ? (c[0]*54 + c[1]*183 + c[2]*19 + 128) >> 8 : c[0];
+    }
+    
+    // otsu's threshold
+    uint64_t histogram[256] = {};
+    for(auto value : gray)
+        histogram[value]++;
+    double total = 0;
+    for(int i = 0; i < 256; i++)
+        total += double(i)*histogram[i];
+    double below_sum = 0, best = -1;
+    uint64_t below = 0;
+    int threshold = 127;
+    for(int i = 0; i < 255; i++)
+    {
+        below += histogram[i];
+        below_sum += double(i)*histogram[i];
+        if(below == 0 or below == count)
+            continue;
+        double mean_below = below_sum/below;
+        double mean_above = (total-below_sum)/(count-below);
+        double between = double(below)*(count-below)*(mean_below-mean_above)*(mean_below-mean_above);
+        if(between > best)
+        {
+            best = between;
+            threshold = i;
+        }
+    }
+    // ink is whichever side of the threshold there's less of, so that white on black pages work too (like estimate_width)
+    uint64_t dark = 0;
+    for(int i = 0; i <= threshold; i++)
+        dark += histogram[i];
+    bool inverted = dark > count/2;
+    std::vector<unsigned char> ink(count);
+    for(size_t i = 0; i < count; i++)
+        ink[i] = inverted ? gray[i] > threshold : gray[i] <= threshold;
+    gray = std::vector<unsigned char>();
+    
+    // connected components (8-connected) over runs of ink, so memory goes with the amount of ink rather than the page size
+    struct run {
+        int x1, x2, y; // x2 exclusive
+        int parent;
+    };
+    std::vector<run> runs;
+    auto find = [&](int i)
+    {
+        while(runs[i].parent != i)
+        {
+            runs[i].parent = runs[runs[i].parent].parent;
+            i = runs[i].parent;
+        }
+        return i;
+    };
+    size_t previous_start = 0, previous_end = 0;
+    for(int y = 0; y < h; y++)
+    {
+        size_t start = runs.size();
+        const unsigned char * row = &ink[size_t(y)*w];
+        for(int x = 0; x < w;)
+        {
+            if(!row[x])
+            {
+                x++;
+                continue;
+            }
+            int x1 = x;
+            while(x < w and row[x])
+                x++;
+            int me = runs.size();
+            runs.push_back({x1, x, y, me});
+            // runs in the row above that touch this one, diagonals included
+            while(previous_start < previous_end and runs[previous_start].x2 < x1)
+                previous_start++;
+            for(size_t i = previous_start; i < previous_end and runs[i].x1 <= x; i++)
+            {
+                int a = find(me);
+                int b = find(i);
+                if(a != b)
+                    runs[std::max(a, b)].parent = std::min(a, b);
+            }
+        }
+        previous_start = start;
+        previous_end = runs.size();
+    }
+    
+    struct component {
+        int x1, y1, x2, y2; // exclusive
+        int count = 0;
+    };
+    std::vector<component> components;
+    std::vector<int> component_of(runs.size(), -1); // by root run
+    for(size_t i = 0; i < runs.size(); i++)
+    {
+        int root = find(i);
+        if(component_of[root] < 0)
+        {
+            component_of[root] = components.size();
+            components.push_back({runs[i].x1, runs[i].y, runs[i].x2, runs[i].y+1, 0});
+        }
+        auto & c = components[component_of[root]];
+        c.x1 = std::min(c.x1, runs[i].x1);
+        c.x2 = std::max(c.x2, runs[i].x2);
+        c.y2 = std::max(c.y2, runs[i].y+1);
+        c.count += runs[i].x2-runs[i].x1;
+    }
+    runs = std::vector<run>();
+    
+    // things that could be characters or parts of them; panel borders, big areas of ink, and screentone dots are all left out
+    int largest = std::max(12, std::min(w, h)/8);
+    std::vector<component> glyphs;
+    for(const auto & c : components)
+    {
+        int cw = c.x2-c.x1;
+        int ch = c.y2-c.y1;
+        if(std::max(cw, ch) < 5 or std::max(cw, ch) > largest)
+            continue;
+        if(c.count > cw*ch*0.85 and std::min(cw, ch) > 3)
+            continue;
+        glyphs.push_back(c);
+    }
+    components = std::vector<component>();
+    
+    // merges boxes that come within margin(box) of each other into one box; returns which new box each old one went into
+    auto merge = [&](std::vector<component> & boxes, auto margin)
+    {
+        std::vector<int> order(boxes.size());
+        int widest = 0;
+        for(size_t i = 0; i < boxes.size(); i++)
+        {
+            order[i] = i;
+            widest = std::max(widest, margin(boxes[i]));
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b){ return boxes[a].x1 < boxes[b].x1; });
+        
+        std::vector<int> parent(boxes.size());
+        for(size_t i = 0; i < boxes.size(); i++)
+            parent[i] = i;
+        auto group_of = [&](int i)
+        {
+            while(parent[i] != i)
+            {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        };
+        for(size_t i = 0; i < order.size(); i++)
+        {
+            const auto & a = boxes[order[i]];
+            for(size_t j = i+1; j < order.size() and boxes[order[j]].x1 <= a.x2 + widest; j++)
+            {
+                const auto & b = boxes[order[j]];
+                int m = std::max(margin(a), margin(b));
+                if(b.x1 > a.x2 + m or b.y1 > a.y2 + m or a.y1 > b.y2 + m)
+                    continue;
+                int ga = group_of(order[i]);
+                int gb = group_of(order[j]);
+                if(ga != gb)
+                    parent[std::max(ga, gb)] = std::min(ga, gb);
+            }
+        }
+        
+        std::vector<component> merged;
+        std::vector<int> index(boxes.size(), -1), owner(boxes.size());
+        for(size_t i = 0; i < boxes.size(); i++)
+        {
+            int g = group_of(i);
+            if(index[g] < 0)
+            {
+                index[g] = merged.size();
+                merged.push_back(boxes[i]);
+                merged.back().count = 0;
+            }
+            auto & m = merged[index[g]];
+            m.x1 = std::min(m.x1, boxes[i].x1);
+            m.y1 = std::min(m.y1, boxes[i].y1);
+            m.x2 = std::max(m.x2, boxes[i].x2);
+            m.y2 = std::max(m.y2, boxes[i].y2);
+            m.count += boxes[i].count;
+            owner[i] = index[g];
+        }
+        boxes = merged;
+        return owner;
+    };
+    
+    // pieces a third of their size apart or closer: characters, and the characters of a line, since those are packed about as tightly as the parts of a character
+    std::vector<int> sizes_of(glyphs.size());
+    for(size_t i = 0; i < glyphs.size(); i++)
+        sizes_of[i] = std::max(glyphs[i].x2-glyphs[i].x1, glyphs[i].y2-glyphs[i].y1);
+    auto first_owner = merge(glyphs, [](const component & c){ return std::max(c.x2-c.x1, c.y2-c.y1)/3 + 2; });
+    // then lines closer together than most of a line's thickness (roughly a character) are one block of text
+    auto second_owner = merge(glyphs, [](const component & c){ return std::min(c.x2-c.x1, c.y2-c.y1)*4/5 + 2; });
+    std::vector<std::vector<int>> sizes(glyphs.size());
+    for(size_t i = 0; i < sizes_of.size(); i++)
+        sizes[second_owner[first_owner[i]]].push_back(sizes_of[i]);
+    
+    for(size_t g = 0; g < glyphs.size(); g++)
+    {
+        auto & sizes_here = sizes[g];
+        if(sizes_here.size() < 3)
+            continue;
+        
+        int x1 = glyphs[g].x1;
+        int y1 = glyphs[g].y1;
+        int x2 = glyphs[g].x2;
+        int y2 = glyphs[g].y2;
+        uint64_t inked = glyphs[g].count;
+        // pieces of characters are smaller than whole ones, so the bigger pieces say more about the size of the text
+        std::nth_element(sizes_here.begin(), sizes_here.begin() + sizes_here.size()*3/4, sizes_here.end());
+        int typical = sizes_here[sizes_here.size()*3/4];
+        int bw = x2-x1;
+        int bh = y2-y1;
+        double density = double(inked)/(double(bw)*bh);
+        // too small to read, mostly ink, or most of the page is art rather than text
+        if(typical < 8 or density < 0.03 or density > 0.6 or double(bw)*bh > double(w)*h*0.25)
+            continue;
+        
+        // projection profiles: lines are runs of inked columns (vertical text) or rows (horizontal text)
+        std::vector<int> columns(bw), rows(bh);
+        for(int y = y1; y < y2; y++)
+        {
+            const unsigned char * row = &ink[size_t(y)*w];
+            for(int x = x1; x < x2; x++)
+            {
+                if(row[x])
+                {
+                    columns[x-x1]++;
+                    rows[y-y1]++;
+                }
+            }
+        }
+        // a single line only has gaps along its length; with several lines, the characters are usually lined up across lines too,
+        // so both profiles have gaps, and the space between lines is the wider one
+        // gaps narrower than a quarter of a character are inside characters and don't split lines
+        int gap = std::max(2, typical/4);
+        auto lines_in = [&](const std::vector<int> & profile, float * thickness, float * spacing)
+        {
+            int lines = 0, inked_total = 0, blank = gap, gaps = 0, blank_total = 0;
+            for(int value : profile)
+            {
+                if(value > 0)
+                {
+                    if(blank >= gap)
+                    {
+                        if(lines > 0)
+                        {
+                            gaps++;
+                            blank_total += blank;
+                        }
+                        lines++;
+                    }
+                    blank = 0;
+                    inked_total++;
+                }
+                else
+                    blank++;
+            }
+            *thickness = lines ? float(inked_total)/lines : 0;
+            *spacing = gaps ? float(blank_total)/gaps : 0;
+            return lines;
+        };
+        float vertical_thickness, horizontal_thickness, vertical_spacing, horizontal_spacing;
+        int vertical_lines = lines_in(columns, &vertical_thickness, &vertical_spacing);
+        int horizontal_lines = lines_in(rows, &horizontal_thickness, &horizontal_spacing);
+        
+        bool vertical;
+        if(vertical_lines == 1 and horizontal_lines > 1)
+            vertical = true;
+        else if(horizontal_lines == 1 and vertical_lines > 1)
+            vertical = false;
+        else if(vertical_spacing != horizontal_spacing)
+            vertical = vertical_spacing > horizontal_spacing;
+        else
+            vertical = bh >= bw;
+        
+        textblock b;
+        b.mode = vertical ? 0 : 1;
+        b.lines = vertical ? vertical_lines : horizontal_lines;
+        b.pixel_scale = std::max(7, int(round(vertical ? vertical_thickness : horizontal_thickness)));
+        // the same breathing room a region dragged around the text would have
+        int pad = b.pixel_scale/4 + 2;
+        b.x1 = std::max(0, x1-pad);
+        b.y1 = std::max(0, y1-pad);
+        b.x2 = std::min(w, x2+pad);
+        b.y2 = std::min(h, y2+pad);
+        blocks.push_back(b);
+    }
+    return blocks;
+}
+
+// text blocks by page, found on worker threads so that proposals are ready by the time a page is shown
+// pages that the decoder prefetches get looked at right after they're decoded, on the decoder's thread
+struct textfinder {
+    struct job {
+        std::string path;
+        std::vector<unsigned char> pixels;
+        int w, h, n;
+    };
+    std::mutex mutex;
+    std::condition_variable wakeup; // for workers: new jobs or quitting
+    std::deque<job> queue;
+    std::set<std::string> queued;
+    std::map<std::string, std::vector<textblock>> found;
+    std::vector<std::thread> workers;
+    bool quitting = false;
+    
+    textfinder(int threads)
+    {
+        if(threads < 1) threads = 1;
+        for(int i = 0; i < threads; i++)
+            workers.push_back(std::thread([this](){ work(); }));
+    }
+    ~textfinder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quitting = true;
+            queue.clear();
+        }
+        wakeup.notify_all();
+        for(auto & thread : workers)
+            thread.join();
+    }
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            wakeup.wait(lock, [this](){ return quitting or queue.size() > 0; });
+            if(quitting) return;
+            
+            job j = std::move(queue.front());
+            queue.pop_front();
+            
+            lock.unlock();
+            auto blocks = find_text_blocks(j.pixels.data(), j.w, j.h, j.n);
+            lock.lock();
+            
+            queued.erase(j.path);
+            found[j.path] = blocks;
+            glfwPostEmptyEvent();
+        }
+    }
+    // any thread; for pages that are already decoded on a worker thread
+    void analyze(const std::string & path, const unsigned char * pixels, int w, int h, int n)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(found.count(path) > 0 or queued.count(path) > 0)
+                return;
+        }
+        auto blocks = find_text_blocks(pixels, w, h, n);
+        std::lock_guard<std::mutex> lock(mutex);
+        found[path] = blocks;
+    }
+    // main thread; copies the page and looks at it in the background if it hasn't been already
+    void want(const std::string & path, const unsigned char * pixels, int w, int h, int n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(found.count(path) > 0 or queued.count(path) > 0)
+            return;
+        queued.insert(path);
+        queue.push_front({path, std::vector<unsigned char>(pixels, pixels + size_t(w)*h*n), w, h, n});
+        wakeup.notify_one();
+    }
+    // returns false if the page hasn't been looked at yet
+    bool get(const std::string & path, std::vector<textblock> & blocks)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = found.find(path);
+        if(it == found.end())
+            return false;
+        blocks = it->second;
+        return true;
+    }
+    // so that a dismissed proposal doesn't come back when the page is opened again
+    void dismiss(const std::string & path, const textblock & b)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto & blocks = found[path];
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [&](const textblock & other){ return memcmp(&other, &b, sizeof(b)) == 0; }), blocks.end());
+    }
+};
+
 struct textobject {
     std::string text;
 };
@@ -2367,6 +5437,240 @@ int ocrmode = 0;
 int shear_y = 0;
 int shear_x = 0;
 
+// pages of a directory (path ending in a slash) or archive, in reading order, along with the names their region files are keyed on
+// returns false if the directory or archive couldn't be opened
+bool list_pages(const std::string & path, std::string & folder, std::vector<std::string> & mydir, std::vector<std::string> & mydir_filenames)
+{
+    {
+        int i;
+        for(i = path.length()-2; i > 0 and path[i] != '/' and path[i] != '\\'; i--);
+        if(path[i] == '/' or path[i] == '\\') i += 1;
+        folder = path.substr(i).data();
+        puts(folder.data());
+    }
+    
+    if(looks_like_archive_filename(path))
+    {
+        auto archive = open_archive(path);
+        if(!archive)
+        {
+            puts("failed to open archive");
+            puts(path.data());
+            return false;
+        }
+        
+        // regions are keyed on the archive's name and the entry's path within it
+        folder += "/";
+        
+        std::vector<std::string> names;
+        for(const auto & entry : archive->zip.entries)
+        {
+            if(looks_like_image_filename(entry.name))
+                names.push_back(entry.name);
+        }
+        std::sort(names.begin(), names.end(), natural_less);
+        for(const auto & name : names)
+        {
+            mydir.push_back(path + "/" + name);
+            auto flattened = name;
+            std::replace(flattened.begin(), flattened.end(), '/', '_');
+            mydir_filenames.push_back(flattened);
+        }
+    }
+    else
+    {
+        auto entries = list_directory(path);
+        if(entries.size() == 0)
+        {
+            puts("failed to open directory");
+            puts(path.data());
+            return false;
+        }
+        
+        for(const auto & text : entries)
+        {
+            std::string str = path + text;
+            if(looks_like_image_filename(str))
+            {
+                mydir.push_back(str);
+                mydir_filenames.push_back(text);
+            }
+        }
+        
+        // we are now done operating with the filesystem!
+        
+        std::sort(mydir.begin(), mydir.end(), natural_less);
+        std::sort(mydir_filenames.begin(), mydir_filenames.end(), natural_less);
+    }
+    return true;
+}
+
+// --batch-ocr: fills in every region without text in the given folders/archives, without opening a window
+int batch_ocr(const std::vector<std::string> & paths, const std::string & cwd)
+{
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    ocrqueue myocr(threads, false);
+    printf("running batch OCR with %d threads\n", threads);
+    
+    // pages stay here until all of their regions come back, then get written out
+    struct batchpage {
+        std::string folder, filename;
+        int w, h;
+        std::vector<region> regions;
+        int remaining = 0;
+    };
+    std::map<uint64_t, batchpage *> owners;
+    
+    int pages_seen = 0, pages_done = 0, regions_done = 0, regions_failed = 0, regions_cached = 0;
+    double pixels = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    auto collect = [&]()
+    {
+        for(const auto & job : myocr.wait_results())
+        {
+            auto page = owners[job.id];
+            owners.erase(job.id);
+            for(auto & r : page->regions)
+            {
+                if(r.pending != job.id)
+                    continue;
+                r.pending = 0;
+                if(job.ok)
+                {
+                    r.text = job.text;
+                    regions_done++;
+                    if(job.text != "")
+                        ocrresults.put(job.cachekey, job.text);
+                }
+                else
+                    regions_failed++;
+            }
+            if(--page->remaining == 0)
+            {
+                write_regions_from(page->regions, page->folder, page->filename, page->w, page->h);
+                pages_done++;
+                delete page;
+            }
+        }
+    };
+    
+    for(auto path : paths)
+    {
+        #ifdef _WIN32
+        if(path.length() > 2 and (path[1] != ':' or path[2] != '\\'))
+            path = cwd+path;
+        #else
+        if(path.length() > 0 and path[0] != '/')
+            path = cwd+path;
+        #endif
+        if(!looks_like_archive_filename(path) and path.length() > 0 and path[path.length()-1] != '/' and path[path.length()-1] != '\\')
+            path += "/";
+        
+        std::string folder;
+        std::vector<std::string> mydir;
+        std::vector<std::string> mydir_filenames;
+        if(!list_pages(path, folder, mydir, mydir_filenames))
+            continue;
+        
+        for(size_t i = 0; i < mydir.size(); i++)
+        {
+            pages_seen++;
+            
+            // the page size only matters for coordinates, so look for regions without text before decoding anything
+            std::vector<region> regions;
+            load_regions_into(regions, folder, mydir_filenames[i], 1, 1);
+            if(std::none_of(regions.begin(), regions.end(), [](const region & r){ return r.text == ""; }))
+                continue;
+            
+            auto img = decode_image(mydir[i].data());
+            if(!img.data)
+            {
+                puts("failed to decode page");
+                puts(mydir[i].data());
+                continue;
+            }
+            
+            int cached_before = regions_cached;
+            auto page = new batchpage;
+            page->folder = folder;
+            page->filename = mydir_filenames[i];
+            page->w = img.w;
+            page->h = img.h;
+            load_regions_into(page->regions, folder, mydir_filenames[i], img.w, img.h);
+            
+            for(auto & r : page->regions)
+            {
+                if(r.text != "")
+                    continue;
+                
+                // keep memory for queued crops bounded
+                while(owners.size() >= size_t(threads)*4)
+                    collect();
+                
+                ocrqueue::job job;
+                job.data = crop_copy(img.data, img.w, img.h, img.n, r.x1, r.y1, r.x2, r.y2, &job.w, &job.h, &job.n, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma, true);
+                pixels += double(job.w)*job.h;
+                
+                job.folder = page->folder;
+                job.filename = page->filename;
+                job.page_w = img.w;
+                job.page_h = img.h;
+                job.x1 = r.x1;
+                job.y1 = r.y1;
+                job.x2 = r.x2;
+                job.y2 = r.y2;
+                
+                // the same settings the region was set up with in the viewer
+                job.tempdir = profile();
+                job.commandfile = ocr_command_file(r.mode);
+                job.scale = std::to_string(32/float(r.pixel_scale)*200);
+                job.xshear = std::to_string(r.yskew/100.0);
+                job.yshear = std::to_string(r.xskew/100.0);
+                job.timeout = ocr_timeout;
+                job.preprocess = ocr_preprocess;
+                
+                job.cachekey = ocrcache::make_key(job, r.gamma);
+                std::string cached;
+                if(ocrresults.get(job.cachekey, cached))
+                {
+                    free(job.data);
+                    r.text = cached;
+                    regions_cached++;
+                    continue;
+                }
+                
+                r.pending = myocr.submit(job);
+                owners[r.pending] = page;
+                page->remaining++;
+            }
+            release_image(img);
+            
+            // everything might have come from the cache
+            if(page->remaining == 0)
+            {
+                if(regions_cached > cached_before)
+                {
+                    write_regions_from(page->regions, page->folder, page->filename, page->w, page->h);
+                    pages_done++;
+                }
+                delete page;
+            }
+        }
+    }
+    while(owners.size() > 0)
+        collect();
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int regions = regions_done + regions_failed;
+    printf("batch OCR done: %d pages looked at, %d pages updated\n", pages_seen, pages_done);
+    printf("%d regions OCRed, %d produced no output, %d came from the OCR cache\n", regions_done, regions_failed, regions_cached);
+    printf("%.1f seconds, %.2f regions per second, %.2f megapixels per second\n",
+        seconds, seconds > 0 ? regions/seconds : 0.0, seconds > 0 ? pixels/1000000/seconds : 0.0);
+    
+    return regions_failed > 0 ? 1 : 0;
+}
+
 #ifdef _WIN32
 
 int wmain (int argc, wchar_t ** argv)
@@ -2392,6 +5696,17 @@ int wmain (int argc, wchar_t ** argv)
     SetConsoleCP(65001);
     SetConsoleOutputCP(65001);
     
+    std::vector<std::string> args;
+    for(int i = 1; i < argc; i++)
+    {
+        char * converted = (char *)utf16_to_utf8((uint16_t *)(argv[i]), &status);
+        if(converted)
+        {
+            args.push_back(converted);
+            free(converted);
+        }
+    }
+    
     // store CWD
     std::string cwd;
     {
@@ -2443,6 +5758,10 @@ int main(int argc, char ** argv)
     }
     char * arg = argv[1];
     
+    std::vector<std::string> args;
+    for(int i = 1; i < argc; i++)
+        args.push_back(argv[i]);
+    
     // store CWD
     std::string cwd;
     {
@@ -2482,9 +5801,28 @@ int main(int argc, char ** argv)
     
     setlocale(LC_NUMERIC, "C");
     
+    #ifndef _WIN32
+    // OCR scripts and engines that exit without reading all of their input shouldn't take us down with them
+    signal(SIGPIPE, SIG_IGN);
+    #endif
+    
     load_config();
     init_font();
     
+    pagediskcache.open(std::max(double(disk_cache_bytes), 0.0));
+    if(ocr_cache)
+        ocrresults.open(profile()+"ocrcache.bin");
+    
+    if(args[0] == "--batch-ocr")
+    {
+        if(args.size() < 2)
+        {
+            puts("--batch-ocr needs at least one folder or archive");
+            return 1;
+        }
+        return batch_ocr(std::vector<std::string>(args.begin()+1, args.end()), cwd);
+    }
+    
     float x = 0;
     float y = 0;
     
@@ -2511,181 +5849,275 @@ int main(int argc, char ** argv)
         filename = path.substr(i+1);
         path = path.substr(0, i+1);
     }
-    {
-        int i;
-        for(i = path.length()-2; i > 0 and path[i] != '/' and path[i] != '\\'; i--);
-        if(path[i] == '/' or path[i] == '\\') i += 1;
-        folder = path.substr(i).data();
-        puts(folder.data());
-    }
-    
-    // TODO: abstract win32 dirent logic into own header
-    // the dirent.h we're using here converts from ANSI instead of from utf-8 for the non-wchar version, making it useless
-    
-    #ifdef _WIN32
+    std::vector<std::string> mydir;
+    std::vector<std::string> mydir_filenames;
     
-    wchar_t * dircstr = (wchar_t *)utf8_to_utf16((uint8_t *)path.data(), &status);
-    if(!dircstr)
+    if(!list_pages(path, folder, mydir, mydir_filenames))
     {
-        puts("failed convert directory string");
         getchar();
         return 0;
     }
-    auto dir = _wopendir(dircstr);
-    free(dircstr);
-    
-    #else
-    
-    auto dir = opendir(path.data());
-    
-    #endif
+    if(mydir.size() == 0) return 0;
     
-    if(!dir)
+    int index = 0;
+    if(from_filename)
     {
-        puts("failed to open directory");
-        puts(path.data());
-        getchar();
-        return 0;
+        for(size_t i = 0; i < mydir.size(); i++)
+        {
+            std::string testpath = std::string(mydir[i]);
+            int j = 0;
+            for(j = testpath.length()-1; j > 0 and testpath[j] != '/' and testpath[j] != '\\'; j--);
+            
+            std::string testfilename = testpath.substr(j+1);
+            
+            if(testfilename == filename)
+            {
+                index = i;
+                break;
+            }
+        }
     }
     
-    std::vector<std::string> mydir;
-    std::vector<std::string> mydir_filenames;
+    renderer myrenderer;
     
-    #ifdef _WIN32
+    auto & win = myrenderer.win;
+    glfwSetScrollCallback(win, myScrollEventCallback);
+    glfwSetKeyCallback(win, myKeyEventCallback);
+    glfwSetErrorCallback(error_callback);
+    glfwSetWindowRefreshCallback(win, [](GLFWwindow * win){ redraw_requested = true; });
     
-    _wdirent * myent = _wreaddir(dir);
-    #else
     
-    dirent * myent = readdir(dir);
+    // before the decoder, which calls into it
+    textfinder myfinder(1);
+    pagedecoder mydecoder(decode_threads);
+    pagecache mycache(&myrenderer);
+    ocrqueue myocr(ocr_threads);
+    if(propose_regions)
+    {
+        mydecoder.decoded = [&](const std::string & path, const decodedimage & img)
+        {
+            myfinder.analyze(path, img.data, img.w, img.h, img.n);
+        };
+    }
     
-    #endif
+    // which way the reader last turned; pages in that direction get decoded first
+    int page_direction = 1;
+    auto prefetch_neighbors = [&]()
+    {
+        std::vector<std::string> wanted;
+        for(int i = 1; i <= int(prefetch_pages); i++)
+        {
+            int ahead = index + page_direction*i;
+            int behind = index - page_direction*i;
+            if(ahead >= 0 and ahead < int(mydir.size()))
+                wanted.push_back(mydir[ahead]);
+            if(behind >= 0 and behind < int(mydir.size()))
+                wanted.push_back(mydir[behind]);
+        }
+        wanted.erase(std::remove_if(wanted.begin(), wanted.end(), [&](const std::string & path){ return mycache.has(path); }), wanted.end());
+        mydecoder.prefetch(wanted);
+    };
     
-    while(myent)
+    auto open_page = [&](int i)
     {
-        #ifdef _WIN32
-        
-        char * text = (char *)utf16_to_utf8((uint16_t *)myent->d_name, &status);
-        if(!text) return 0;
-        
-        #else
-        
-        char * text = myent->d_name;
-        
-        #endif
-        
-        std::string str = path + text;
-        if(looks_like_image_filename(str))
+        auto tex = mycache.get(mydir[i]);
+        if(!tex)
         {
-            mydir.push_back(str);
-            mydir_filenames.push_back(std::string(text));
+            tex = myrenderer.load_texture(mydecoder.take(mydir[i]));
+            if(tex)
+                mycache.put(mydir[i], tex);
         }
-        
-        #ifdef _WIN32
-        
-        free(text);
-        myent = _wreaddir(dir);
-        
-        #else
-        
-        myent = readdir(dir);
-        
-        #endif
-    }
+        return tex;
+    };
     
-    #ifdef _WIN32
-    _wclosedir(dir);
-    #else
-    closedir(dir);
-    #endif
+    auto myimage = open_page(index);
+    if(!myimage) return 0;
+    prefetch_neighbors();
     
-    // we are now done operating with the filesystem!
     
-    if(mydir.size() == 0) return 0;
+    load_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
+    myocr.mark_pending(regions, folder, mydir_filenames[index]);
     
-    auto sortfunction = [](std::string a, std::string b) {
-        auto numeric = [](const char & c) {return (c >= '0' and c <= '9');};
-        size_t i;
-        for(i = 0; i < a.length() and i < b.length() and a[i] == b[i]; i++);
-        // same length, identical
-        if(i == a.length() and i == b.length())
-            return false;
-        // ran out of length before a difference
-        if(i < a.length() and i >= b.length())
-            return false;
-        if(i < b.length() and i >= a.length())
-            return true;
-        char c1 = a[i];
-        char c2 = b[i];
-        if(c1 == 0)
-            return true;
-        if(c2 == 0)
-            return false;
-        // difference is not numeric
-        if(!numeric(c1) and !numeric(c2))
-            return c1 < c2;
-        
-        size_t start;
-        if(i > 0 and numeric(a[i-1]))
-            start = i-1;
+    // proposed regions for the current page, once it's been looked at
+    std::string proposals_for;
+    auto update_proposals = [&]()
+    {
+        if(!propose_regions or proposals_for == mydir[index])
+            return;
+        proposals.clear();
+        if(myfinder.get(mydir[index], proposals))
+            proposals_for = mydir[index];
         else
-            start = i;
+            myfinder.want(mydir[index], myimage->mydata, myimage->w, myimage->h, myimage->n);
+    };
+    
+    // fills in the region an OCR job was for, even if it's on a page that isn't open anymore
+    auto apply_ocr_result = [&](const ocrqueue::job & job)
+    {
+        // the region it was for was deleted
+        if(job.cancel->load())
+            return;
         
-        size_t end1, end2;
-        for(end1 = 0; start+end1 < a.length() and numeric(a[start+end1]); end1++);
-        for(end2 = 0; start+end2 < b.length() and numeric(b[start+end2]); end2++);
-        if(end1 == 0 or end2 == 0) return c1 < c2;
+        if(job.ok and job.text != "")
+            ocrresults.put(job.cachekey, job.text);
         
-        try
+        bool here = job.folder == folder and job.filename == mydir_filenames[index];
+        std::vector<region> elsewhere;
+        if(!here)
+            load_regions_into(elsewhere, job.folder, job.filename, job.page_w, job.page_h);
+        auto & list = here ? regions : elsewhere;
+        
+        region * target = nullptr;
+        for(auto & r : list)
+            if(r.pending == job.id)
+                target = &r;
+        if(!target)
+        {
+            for(auto & r : list)
+            {
+                if(r.x1 == job.x1 and r.y1 == job.y1 and r.x2 == job.x2 and r.y2 == job.y2 and r.text == "")
+                {
+                    target = &r;
+                    break;
+                }
+            }
+        }
+        if(!target)
         {
-            int num1 = std::stoll(a.substr(start, end1));
-            int num2 = std::stoll(b.substr(start, end2));
-            return (num1 < num2);
+            puts("region for OCR result no longer exists");
+            return;
         }
-        catch(const std::invalid_argument & e)
+        
+        target->pending = 0;
+        if(!job.ok)
         {
-            return c1 < c2;
+            puts("OCR produced no output");
+            return;
         }
-        catch(const std::out_of_range & e)
+        target->text = job.text;
+        puts(target->text.data());
+        
+        if(here)
         {
-            return c1 < c2;
+            if(target == currentregion)
+            {
+                glfwSetClipboardString(win, target->text.data());
+                currentsubtitle = subtitle(target->text, 24, &myrenderer);
+            }
+            write_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
         }
+        else
+            write_regions_from(elsewhere, job.folder, job.filename, job.page_w, job.page_h);
     };
     
-    std::sort(mydir.begin(), mydir.end(), sortfunction);
-    std::sort(mydir_filenames.begin(), mydir_filenames.end(), sortfunction);
-    
-    int index = 0;
-    if(from_filename)
+    // pages whose regions without text have been queued for OCR ahead of time
+    std::set<std::string> speculated;
+    // does that for the current page and the next few in the reading direction, as their pixels become available
+    auto speculate = [&]()
     {
-        for(size_t i = 0; i < mydir.size(); i++)
+        for(int k = 0; k < int(speculative_ocr); k++)
         {
-            std::string testpath = std::string(mydir[i]);
-            int j = 0;
-            for(j = testpath.length()-1; j > 0 and testpath[j] != '/' and testpath[j] != '\\'; j--);
+            int i = index + page_direction*k;
+            if(i < 0 or i >= int(mydir.size()))
+                break;
+            if(speculated.count(mydir[i]))
+                continue;
+            bool here = i == index;
             
-            std::string testfilename = testpath.substr(j+1);
+            // pixels come from the open page, the page cache, or a page the decoder has ready
+            auto tex = here ? myimage : mycache.peek(mydir[i]);
+            int w = 0, h = 0;
+            bool ready = true;
+            if(tex)
+            {
+                w = tex->w;
+                h = tex->h;
+            }
+            else
+                ready = mydecoder.peek(mydir[i], [&](const decodedimage & img){ if(img.data) w = img.w, h = img.h; });
+            // not decoded yet, so try again later
+            if(!ready)
+                continue;
             
-            if(testfilename == filename)
+            std::vector<region> elsewhere;
+            if(!here and w > 0)
             {
-                index = i;
-                break;
+                load_regions_into(elsewhere, folder, mydir_filenames[i], w, h);
+                myocr.mark_pending(elsewhere, folder, mydir_filenames[i]);
             }
+            auto & list = here ? regions : elsewhere;
+            
+            std::vector<region *> wanted;
+            for(auto & r : list)
+                if(r.text == "" and !r.pending)
+                    wanted.push_back(&r);
+            
+            std::vector<ocrqueue::job> jobs(wanted.size());
+            bool cropped = false;
+            auto crop_all = [&](const unsigned char * pixels, int n)
+            {
+                if(!pixels)
+                    return;
+                for(size_t j = 0; j < wanted.size(); j++)
+                {
+                    auto & r = *wanted[j];
+                    auto & job = jobs[j];
+                    job.data = crop_copy(pixels, w, h, n, r.x1, r.y1, r.x2, r.y2, &job.w, &job.h, &job.n, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma, true);
+                }
+                cropped = true;
+            };
+            if(wanted.size() == 0)
+                cropped = true;
+            else if(tex)
+                crop_all(tex->mydata, tex->n);
+            // only the crops get made while the decoder is locked; the page might also have been dropped since it was looked at above
+            else if(!mydecoder.peek(mydir[i], [&](const decodedimage & img){ crop_all(img.data, img.n); }))
+                continue;
+            
+            bool changed = false;
+            for(size_t j = 0; cropped and j < wanted.size(); j++)
+            {
+                auto & r = *wanted[j];
+                auto & job = jobs[j];
+                
+                job.folder = folder;
+                job.filename = mydir_filenames[i];
+                job.page_w = w;
+                job.page_h = h;
+                job.x1 = r.x1;
+                job.y1 = r.y1;
+                job.x2 = r.x2;
+                job.y2 = r.y2;
+                
+                // the settings the region was last OCRed or set up with, like batch OCR
+                job.tempdir = profile();
+                job.commandfile = ocr_command_file(r.mode);
+                job.scale = std::to_string(32/float(r.pixel_scale)*200);
+                job.xshear = std::to_string(r.yskew/100.0);
+                job.yshear = std::to_string(r.xskew/100.0);
+                job.timeout = ocr_timeout;
+                job.preprocess = ocr_preprocess;
+                job.speculative = true;
+                
+                job.cachekey = ocrcache::make_key(job, r.gamma);
+                std::string cached;
+                if(ocrresults.get(job.cachekey, cached))
+                {
+                    free(job.data);
+                    r.text = cached;
+                    changed = true;
+                    continue;
+                }
+                r.pending = myocr.submit(job);
+            }
+            if(changed and here)
+                write_regions(folder, mydir_filenames[i], w, h);
+            else if(changed)
+                write_regions_from(elsewhere, folder, mydir_filenames[i], w, h);
+            speculated.insert(mydir[i]);
         }
-    }
-    
-    renderer myrenderer;
-    
-    auto & win = myrenderer.win;
-    glfwSetScrollCallback(win, myScrollEventCallback);
-    glfwSetKeyCallback(win, myKeyEventCallback);
-    glfwSetErrorCallback(error_callback);
-    
-    
-    auto myimage = myrenderer.load_texture(mydir[index].data());
-    if(!myimage) return 0;
-    
+    };
     
-    load_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
     // set default position
     
     float xscale, yscale, scale; // "scale" is actually used to scale the image. xscale and yscale are for logic.
@@ -2745,10 +6177,10 @@ int main(int argc, char ** argv)
         if(go_to_last_page and index > 0)
         {
             puts("entering A");
+            page_direction = -1;
             repeat:
             index = std::max(index-1, 0);
-            myrenderer.delete_texture(myimage);
-            myimage = myrenderer.load_texture(mydir[index].data());
+            myimage = open_page(index);
             if(!myimage and index > 0)
             {
                 puts("looping A");
@@ -2757,9 +6189,12 @@ int main(int argc, char ** argv)
             else if(!myimage)
             {
                 index = 0;
-                myimage = myrenderer.load_texture(mydir[0].data());
+                myimage = open_page(0);
             }
+            mycache.trim(myimage);
             load_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
+            myocr.mark_pending(regions, folder, mydir_filenames[index]);
+            prefetch_neighbors();
             if(reset_position_on_new_page)
             {
                 getscale(myrenderer.w, myrenderer.h, myimage->w, myimage->h, xscale, yscale, scale);
@@ -2769,10 +6204,10 @@ int main(int argc, char ** argv)
         if(go_to_next_page and index < int(mydir.size()-1))
         {
             //puts("entering B");
+            page_direction = 1;
             repeat2:
             index = std::min(index+1, int(mydir.size()-1));
-            myrenderer.delete_texture(myimage);
-            myimage = myrenderer.load_texture(mydir[index].data());
+            myimage = open_page(index);
             if(!myimage and index < int(mydir.size()-1))
             {
                 //puts("looping B");
@@ -2781,9 +6216,12 @@ int main(int argc, char ** argv)
             else if(!myimage)
             {
                 index = 0;
-                myimage = myrenderer.load_texture(mydir[0].data());
+                myimage = open_page(0);
             }
+            mycache.trim(myimage);
             load_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
+            myocr.mark_pending(regions, folder, mydir_filenames[index]);
+            prefetch_neighbors();
             if(reset_position_on_new_page)
             {
                 getscale(myrenderer.w, myrenderer.h, myimage->w, myimage->h, xscale, yscale, scale);
@@ -3024,6 +6462,41 @@ int main(int argc, char ** argv)
                 m1_mx_release = mx;
                 m1_my_release = my;
                 
+                // clicking on a proposed region turns it into a real one, which then gets OCR'd below like any region that's clicked on
+                for(size_t i = 0; i < proposals.size(); i++)
+                {
+                    const auto & b = proposals[i];
+                    float x1 = (b.x1*scale-x);
+                    float y1 = (b.y1*scale-y);
+                    float x2 = (b.x2*scale-x);
+                    float y2 = (b.y2*scale-y);
+                    
+                    if (proposal_hidden(b)
+                     or m1_mx_release < x1 or m1_mx_release > x2 or m1_mx_press < x1 or m1_mx_press > x2 
+                     or m1_my_release < y1 or m1_my_release > y2 or m1_my_press < y1 or m1_my_press > y2)
+                        continue;
+                    
+                    region r;
+                    r.x1 = b.x1;
+                    r.y1 = b.y1;
+                    r.x2 = b.x2;
+                    r.y2 = b.y2;
+                    r.mode = ocrmode;
+                    r.pixel_scale = b.pixel_scale;
+                    r.yskew = shear_y;
+                    r.xskew = shear_x;
+                    r.gamma = gamma;
+                    // OCR goes by the text size setting, so this is like setting it to an estimate by hand
+                    textscale = b.pixel_scale;
+                    currentsubtitle = subtitle(std::string("proposed region: ")+std::to_string(b.lines)+(b.mode == 0 ? " vertical" : " horizontal")+" line(s), text size set to "+std::to_string(textscale), 24, &myrenderer);
+                    
+                    myfinder.dismiss(mydir[index], b);
+                    proposals.erase(proposals.begin()+i);
+                    currentregion = 0;
+                    regions.push_back(r);
+                    break;
+                }
+                
                 bool foundregion = false;
                 for(region & r : regions)
                 {
@@ -3090,87 +6563,60 @@ int main(int argc, char ** argv)
                             foundregion = true;
                             break;
                         }
+                        else if(r.pending)
+                        {
+                            puts("OCR for this region is still running");
+                            myocr.promote(r.pending);
+                            currentregion = &r;
+                            foundregion = true;
+                            break;
+                        }
                         else
                         {
                             if(&r == currentregion)
                                 r.gamma = gamma;
                             
-                            int img_w, img_h;
-                            auto data = crop_copy(myimage, r.x1, r.y1, r.x2, r.y2, &img_w, &img_h, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma);
-                            
-                            puts("writing cropped image to disk");
-                            auto f = wrap_fopen((profile()+"temp_ocr.png").data(), "wb");
-                            if(f)
-                            {
-                                stbi_write_png_to_func([](void * file, void * data, int size){
-                                    fwrite(data, 1, size, (FILE *) file);
-                                }, f, img_w, img_h, 4, data, img_w*4);
-                                fclose(f);
-                            }
-                            free(data);
-                            puts("done");
-                            
-                            puts((profile()+"temp_ocr.png").data());
-                            puts((profile()+"ocr.txt").data());
-                            
+                            // saved with the region, so that batch and speculative OCR use the same script and settings
+                            r.mode = ocrmode;
                             r.pixel_scale = textscale;
                             r.yskew = shear_y;
                             r.xskew = shear_x;
                             
-                            std::string scale_double_percent = std::to_string(32/float(textscale)*200);
+                            ocrqueue::job job;
+                            job.data = crop_copy(myimage, r.x1, r.y1, r.x2, r.y2, &job.w, &job.h, &job.n, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma, true);
                             
-                            std::string xshear_string = std::to_string(shear_y/100.0);
-                            std::string yshear_string = std::to_string(shear_x/100.0);
+                            job.folder = folder;
+                            job.filename = mydir_filenames[index];
+                            job.page_w = myimage->w;
+                            job.page_h = myimage->h;
+                            job.x1 = r.x1;
+                            job.y1 = r.y1;
+                            job.x2 = r.x2;
+                            job.y2 = r.y2;
                             
-                            std::string ocrfile;
+                            job.tempdir = profile();
+                            job.scale = std::to_string(32/float(textscale)*200);
+                            job.xshear = std::to_string(shear_y/100.0);
+                            job.yshear = std::to_string(shear_x/100.0);
                             
-                            if(ocrmode == 1)
-                                ocrfile = (profile()+"ocr2.txt");
-                            else if(ocrmode == 2)
-                                ocrfile = (profile()+"ocr3.txt");
-                            else if(ocrmode == 3)
-                                ocrfile = (profile()+"ocr4.txt");
-                            else if(ocrmode == 4)
-                                ocrfile = (profile()+"ocr5.txt");
-                            else if(ocrmode == 5)
-                                ocrfile = (profile()+"ocr6.txt");
-                            else
-                                ocrfile = (profile()+"ocr.txt");
+                            job.commandfile = ocr_command_file(ocrmode);
+                            job.timeout = ocr_timeout;
+                            job.preprocess = ocr_preprocess;
                             
-                            ocr((profile()+"temp_ocr.png").data(), ocrfile.data(), (profile()+"temp_text.txt").data(), (scale_double_percent.data()), xshear_string.data(), yshear_string.data());
+                            puts(job.commandfile.data());
+                            job.cachekey = ocrcache::make_key(job, r.gamma);
                             
-                            auto f2 = wrap_fopen((profile()+"temp_text.txt").data(), "rb");
-                            if(f2)
+                            std::string cached;
+                            if(ocrresults.get(job.cachekey, cached))
                             {
-                                fseek(f2, 0, SEEK_END);
-                                size_t len = ftell(f2);
-                                fseek(f2, 0, SEEK_SET);
-                                
-                                char * s = (char *)malloc(len+1);
-                                
-                                if(s)
-                                {
-                                    fread(s, 1, len, f2);
-                                    s[len] = 0;
-                                    
-                                    // some OCR programs output formfeed characters when invoked by nezuyomi for some reason
-                                    auto mystring = std::string();
-                                    for(char c : std::string(s))
-                                        if (c != 0x0C and c != '\r')
-                                            mystring += c;
-                                    
-                                    r.text = mystring;
-                                    glfwSetClipboardString(win, s);
-                                    
-                                    puts(r.text.data());
-                                    currentsubtitle = subtitle(r.text, 24, &myrenderer);
-                                    //puts("rjkrek");
-                                    
-                                    free(s);
-                                    //puts("fddrtht");
-                                }
-                                fclose(f2);
+                                free(job.data);
+                                r.text = cached;
+                                glfwSetClipboardString(win, r.text.data());
+                                puts(r.text.data());
+                                currentsubtitle = subtitle(r.text, 24, &myrenderer);
                             }
+                            else
+                                r.pending = myocr.submit(job);
                             
                             currentregion = &r;
                             
@@ -3192,9 +6638,9 @@ int main(int argc, char ** argv)
                         auto & r = regions[regions.size()-1];
                         r.gamma = gamma;
                         
-                        int img_w, img_h;
-                        auto data = crop_copy(myimage, r.x1, r.y1, r.x2, r.y2, &img_w, &img_h, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma);
-                        int estimated_width = estimate_width(data, img_w, img_h);
+                        int img_w, img_h, img_n;
+                        auto data = crop_copy(myimage, r.x1, r.y1, r.x2, r.y2, &img_w, &img_h, &img_n, r.skewmode?r.yskew:0, r.skewmode?r.xskew:0, r.gamma, false);
+                        int estimated_width = estimate_width(data, img_w, img_h, img_n);
                         printf("estimated width %d\n", estimated_width);
                         free(data);
                         
@@ -3303,6 +6749,7 @@ int main(int argc, char ** argv)
             m2_mx_release = mx;
             m2_my_release = my;
             
+            bool deleted = false;
             for(size_t i = 0; i < regions.size(); i++)
             {
                 region & r = regions[i];
@@ -3316,12 +6763,32 @@ int main(int argc, char ** argv)
                 {
                     if(&r == currentregion)
                         currentregion = 0;
+                    if(r.pending)
+                        myocr.cancel(r.pending);
                     
                     regions.erase(regions.begin()+i);
                     write_regions(folder, mydir_filenames[index], myimage->w, myimage->h);
+                    deleted = true;
                     break;
                 }
             }
+            // proposed regions just go away
+            for(size_t i = 0; i < proposals.size() and !deleted; i++)
+            {
+                const auto & b = proposals[i];
+                float x1 = (b.x1*scale-x);
+                float y1 = (b.y1*scale-y);
+                float x2 = (b.x2*scale-x);
+                float y2 = (b.y2*scale-y);
+                
+                if (!proposal_hidden(b) and m2_mx_release >= x1 and m2_mx_release <= x2 and m2_mx_press >= x1 and m2_mx_press <= x2 
+                and m2_my_release >= y1 and m2_my_release <= y2 and m2_my_press >= y1 and m2_my_press <= y2)
+                {
+                    myfinder.dismiss(mydir[index], b);
+                    proposals.erase(proposals.begin()+i);
+                    deleted = true;
+                }
+            }
             currentsubtitle = subtitle();
         }
         last_m2 = current_m2;
@@ -3345,167 +6812,67 @@ int main(int argc, char ** argv)
         
         last_v = current_v;
         
+        for(const auto & job : myocr.take_results())
+            apply_ocr_result(job);
+        update_proposals();
+        speculate();
         
+        myrenderer.update_size();
+        limit_position(myrenderer.w, myrenderer.h, myimage->w, myimage->h, xscale, yscale, scale, x, y);
         
-        myrenderer.cycle_start();
+        // only render frames that would look different from the last one
+        struct framestate {
+            float x, y, scale;
+            int w, h;
+            renderer::texture * page;
+            uint64_t regions, subtitle;
+            bool operator==(const framestate & other) const
+            {
+                return x == other.x and y == other.y and scale == other.scale and w == other.w and h == other.h
+                   and page == other.page and regions == other.regions and subtitle == other.subtitle;
+            }
+        };
+        framestate state = {x, y, scale, myrenderer.w, myrenderer.h, myimage, regions_hash(), currentsubtitle.serial};
+        static framestate laststate = {};
         
-        limit_position(myrenderer.w, myrenderer.h, myimage->w, myimage->h, xscale, yscale, scale, x, y);
+        // uploads only progress while frames are being drawn
+        if(myrenderer.uploading())
+            washolding = true;
+        
+        if(state == laststate and !redraw_requested and !myrenderer.uploading())
+        {
+            if(delta < throttle)
+                glfwWaitEventsTimeout(throttle-delta);
+            continue;
+        }
+        laststate = state;
+        redraw_requested = false;
+        
+        myrenderer.cycle_start();
         
         myrenderer.cam_x = x;
         myrenderer.cam_y = y;
         myrenderer.cam_scale = scale;
         
-        myrenderer.draw_texture(myimage, 0, 0, 0.2);
-        
         myrenderer.downscaling = scale < 1;
         myrenderer.infoscale = (scale>1)?(scale):(1);
-        myrenderer.cycle_post();
-        
-        for(region r : regions)
+        if(!myrenderer.draw_scaled_page(myimage, 0.2))
         {
-            if(r.yskew == 0 and r.xskew == 0)
-            {
-                double x1 = (r.x1*myrenderer.cam_scale-myrenderer.cam_x);
-                double y1 = (r.y1*myrenderer.cam_scale-myrenderer.cam_y);
-                double x2 = (r.x2*myrenderer.cam_scale-myrenderer.cam_x);
-                double y2 = (r.y2*myrenderer.cam_scale-myrenderer.cam_y);
-                myrenderer.draw_rect(x1-1, y1-1, x2-1, y1+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x1-1, y1+1, x1+1, y2+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x1+1, y2-1, x2+1, y2+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x2-1, y1-1, x2+1, y2-1, 0.2, 0.8, 1.0, 0.5, true);
-            }
-            else
-            {
-                std::vector<double> xlist1, ylist1, xlist2, ylist2;
-                
-                xlist1.push_back(r.x1 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x2 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x1 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x2 - (r.x1+r.x2)/2.0);
-                
-                ylist1.push_back(r.y1 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y1 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y2 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y2 - (r.y1+r.y2)/2.0);
-                
-                for(int i = 0; i < 4; i++)
-                {
-                    auto x = xlist1[i];
-                    auto y = ylist1[i];
-                    auto ys = r.yskew*0.01;
-                    auto xs = r.xskew*0.01;
-                    xlist2.push_back(x/(1-xs*ys) + y*xs/(xs*ys-1) + (r.x1+r.x2)/2.0);
-                    ylist2.push_back(x*ys/(xs*ys-1) + y/(1-xs*ys) + (r.y1+r.y2)/2.0);
-                }
-                if(r.skewmode == 1)
-                {
-                    float minx = std::min(xlist2[0], xlist2[2]);
-                    float miny = std::min(ylist2[0], ylist2[1]);
-                    float xpad = fabs(minx-r.x1);
-                    float ypad = fabs(miny-r.y1);
-                    
-                    xlist2[0] += xpad;
-                    xlist2[2] += xpad;
-                    xlist2[1] -= xpad;
-                    xlist2[3] -= xpad;
-                    
-                    ylist2[0] += ypad;
-                    ylist2[1] += ypad;
-                    ylist2[2] -= ypad;
-                    ylist2[3] -= ypad;
-                }
-                if(xlist2[1] >= xlist2[0] and ylist2[2] > ylist2[0])
-                {
-                    myrenderer.set_scissor(r.x1, r.y1, r.x2, r.y2);
-                    myrenderer.draw_quad(xlist2[0], ylist2[0], xlist2[1], ylist2[1], xlist2[2], ylist2[2], xlist2[3], ylist2[3], 0.2, 0.8, 1.0, 0.5);
-                    myrenderer.unset_scissor();
-                }
-                if(xlist2[1] < xlist2[0]+2 or ylist2[2] < ylist2[0]+2)
-                {
-                    double x1 = (r.x1*myrenderer.cam_scale-myrenderer.cam_x);
-                    double y1 = (r.y1*myrenderer.cam_scale-myrenderer.cam_y);
-                    double x2 = (r.x2*myrenderer.cam_scale-myrenderer.cam_x);
-                    double y2 = (r.y2*myrenderer.cam_scale-myrenderer.cam_y);
-                    myrenderer.draw_rect(x1-1, y1-1, x2-1, y1+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x1-1, y1+1, x1+1, y2+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x1+1, y2-1, x2+1, y2+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x2-1, y1-1, x2+1, y2-1, 0.8, 0.2, 1.0, 0.5, true);
-                }
-            }
+            myrenderer.draw_texture(myimage, 0, 0, 0.2);
+            myrenderer.cycle_post();
         }
-        // with tempregion too
+        
+        // region overlays only need to be rebuilt when the regions themselves change
+        static bool outlines_built = false;
+        static uint64_t outlines_hash = 0;
+        if(!outlines_built or state.regions != outlines_hash)
         {
-            auto & r = tempregion;
-            if(r.yskew == 0 and r.xskew == 0)
-            {
-                double x1 = (r.x1*myrenderer.cam_scale-myrenderer.cam_x);
-                double y1 = (r.y1*myrenderer.cam_scale-myrenderer.cam_y);
-                double x2 = (r.x2*myrenderer.cam_scale-myrenderer.cam_x);
-                double y2 = (r.y2*myrenderer.cam_scale-myrenderer.cam_y);
-                myrenderer.draw_rect(x1-1, y1-1, x2-1, y1+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x1-1, y1+1, x1+1, y2+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x1+1, y2-1, x2+1, y2+1, 0.2, 0.8, 1.0, 0.5, true);
-                myrenderer.draw_rect(x2-1, y1-1, x2+1, y2-1, 0.2, 0.8, 1.0, 0.5, true);
-            }
-            else
-            {
-                std::vector<double> xlist1, ylist1, xlist2, ylist2;
-                
-                xlist1.push_back(r.x1 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x2 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x1 - (r.x1+r.x2)/2.0);
-                xlist1.push_back(r.x2 - (r.x1+r.x2)/2.0);
-                
-                ylist1.push_back(r.y1 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y1 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y2 - (r.y1+r.y2)/2.0);
-                ylist1.push_back(r.y2 - (r.y1+r.y2)/2.0);
-                
-                for(int i = 0; i < 4; i++)
-                {
-                    auto x = xlist1[i];
-                    auto y = ylist1[i];
-                    auto ys = r.yskew*0.01;
-                    auto xs = r.xskew*0.01;
-                    xlist2.push_back(x/(1-xs*ys) + y*xs/(xs*ys-1) + (r.x1+r.x2)/2.0);
-                    ylist2.push_back(x*ys/(xs*ys-1) + y/(1-xs*ys) + (r.y1+r.y2)/2.0);
-                }
-                if(r.skewmode == 1)
-                {
-                    float minx = std::min(xlist2[0], xlist2[2]);
-                    float miny = std::min(ylist2[0], ylist2[1]);
-                    float xpad = fabs(minx-r.x1);
-                    float ypad = fabs(miny-r.y1);
-                    
-                    xlist2[0] += xpad;
-                    xlist2[2] += xpad;
-                    xlist2[1] -= xpad;
-                    xlist2[3] -= xpad;
-                    
-                    ylist2[0] += ypad;
-                    ylist2[1] += ypad;
-                    ylist2[2] -= ypad;
-                    ylist2[3] -= ypad;
-                }
-                if(xlist2[1] >= xlist2[0] and ylist2[2] > ylist2[0])
-                {
-                    myrenderer.set_scissor(r.x1, r.y1, r.x2, r.y2);
-                    myrenderer.draw_quad(xlist2[0], ylist2[0], xlist2[1], ylist2[1], xlist2[2], ylist2[2], xlist2[3], ylist2[3], 0.2, 0.8, 1.0, 0.5);
-                    myrenderer.unset_scissor();
-                }
-                if(xlist2[1] < xlist2[0]+2 or ylist2[2] < ylist2[0]+2)
-                {
-                    double x1 = (r.x1*myrenderer.cam_scale-myrenderer.cam_x);
-                    double y1 = (r.y1*myrenderer.cam_scale-myrenderer.cam_y);
-                    double x2 = (r.x2*myrenderer.cam_scale-myrenderer.cam_x);
-                    double y2 = (r.y2*myrenderer.cam_scale-myrenderer.cam_y);
-                    myrenderer.draw_rect(x1-1, y1-1, x2-1, y1+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x1-1, y1+1, x1+1, y2+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x1+1, y2-1, x2+1, y2+1, 0.8, 0.2, 1.0, 0.5, true);
-                    myrenderer.draw_rect(x2-1, y1-1, x2+1, y2-1, 0.8, 0.2, 1.0, 0.5, true);
-                }
-            }
+            myrenderer.set_outlines(region_outlines());
+            outlines_hash = state.regions;
+            outlines_built = true;
         }
+        myrenderer.draw_outlines();
+        
         if(currentsubtitle.initialized and fontinitialized)
         {
             float actual_descent = fontface->size->metrics.descender / float(1<<6);
@@ -3516,18 +6883,7 @@ int main(int argc, char ** argv)
             
             myrenderer.draw_rect(0, myrenderer.h - height - 5, myrenderer.w, myrenderer.h, 0, 0, 0, 0.65, true);
             
-            for(unsigned int i = 0; i < currentsubtitle.glyphs.size(); i++)
-            {
-                auto index = currentsubtitle.glyphs[i];
-                const auto & glyph = textcache[index];
-                const auto & pos = currentsubtitle.positions[i];
-                
-                if(glyph->texture)
-                    myrenderer.draw_text_texture(glyph->texture, round(x+pos.x), round(y+pos.y), 0.2);
-                
-                x += pos.x_advance;
-                y += pos.y_advance;
-            }
+            myrenderer.draw_text(currentsubtitle.shaped->vertices, currentsubtitle.shaped->batches, round(x), round(y));
         }
         //myrenderer.draw_rect(-1, -1, 1, 1, 10, 0.2, 0.8, 1.0, 0.4);
         
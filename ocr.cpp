@@ -1,73 +1,987 @@
 #include <stdlib.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <string.h>
+#include <ctype.h>
 
 #include "include/unifile.h"
+#include "include/ocr.h"
 
-bool replace(std::string& str, const std::string& from, const std::string& to) {
-    size_t start_pos = str.find(from);
-    int i = 0;
-    while(start_pos != std::string::npos)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/wait.h>
+extern char ** environ;
+#endif
+
+typedef std::chrono::steady_clock ocrclock;
+
+static double seconds_since(ocrclock::time_point start)
+{
+    return std::chrono::duration<double>(ocrclock::now() - start).count();
+}
+
+// when a run has to stop early: out of time, or cancelled from another thread
+struct ocrdeadline {
+    bool limited;
+    ocrclock::time_point end;
+    std::atomic<bool> * cancel;
+    ocrdeadline(const ocrlimits & limits)
     {
-        str.replace(start_pos, from.length(), to);
-        start_pos = str.find(from);
-        i++;
+        limited = limits.timeout > 0;
+        end = ocrclock::now() + std::chrono::duration_cast<ocrclock::duration>(std::chrono::duration<double>(std::max(limits.timeout, 0.0)));
+        cancel = limits.cancel;
     }
-    printf("replaced %s %d times\n", from.data(), i);
-    return true;
-}
+    bool cancelled() const
+    {
+        return cancel and cancel->load();
+    }
+    bool expired() const
+    {
+        return cancelled() or (limited and ocrclock::now() >= end);
+    }
+};
 
-int ocr(const char * filename, const char * commandfilename, const char * outfilename, const char * scale, const char * xshear, const char * yshear)
+static bool read_script(const char * commandfilename, std::string & command)
 {
     auto f = wrap_fopen(commandfilename,  "rb");
-    if(!f) return 1;
-    
+    if(!f) return false;
+
     fseek(f, 0, SEEK_END);
     auto len = ftell(f);
     fseek(f, 0, SEEK_SET);
     char * data = (char *)malloc(len+1);
-    if(!data) return 1;
+    if(!data)
+    {
+        fclose(f);
+        return false;
+    }
     fread(data, 1, len, f);
     data[len] = 0;
     fclose(f);
-    
-    std::string command = std::string(data);
+
+    command = std::string(data);
     free(data);
-    
-    replace(command, "$SCREENSHOT", std::string(filename));
-    replace(command, "$OUTPUTFILE", std::string(outfilename));
-    replace(command, "$SCALE", std::string(scale));
-    replace(command, "$XSHEAR", std::string(xshear));
-    replace(command, "$YSHEAR", std::string(yshear));
-    
-    //f = fopen("C:\\Users\\wareya\\Desktop\\exe\\tesseract\\testcommand.txt", "wb");
-
-    std::istringstream af(command);
-    std::string line;
+    return true;
+}
+
+// the variables nezuyomi fills in
+enum {
+    VAR_SCREENSHOT,
+    VAR_OUTPUTFILE,
+    VAR_SCALE,
+    VAR_XSHEAR,
+    VAR_YSHEAR,
+    VAR_COUNT
+};
+static const char * variable_names[VAR_COUNT] = {"$SCREENSHOT", "$OUTPUTFILE", "$SCALE", "$XSHEAR", "$YSHEAR"};
+
+// a script split up into literal text and variables, so that filling it in is a single pass that never looks at the values
+struct ocrtemplate {
+    struct segment {
+        std::string literal;
+        int variable = -1;
+    };
+    std::vector<std::vector<segment>> lines; // without empty lines
+    bool uses[VAR_COUNT] = {};
+    std::string server; // engine command, for "server:" scripts
+
+    ocrtemplate(const std::string & script)
+    {
+        if(script.compare(0, 7, "server:") == 0)
+        {
+            auto end = script.find('\n');
+            server = script.substr(7, end == std::string::npos ? std::string::npos : end-7);
+            while(server.length() > 0 and isspace((unsigned char)server[server.length()-1]))
+                server.pop_back();
+            while(server.length() > 0 and isspace((unsigned char)server[0]))
+                server.erase(0, 1);
+            return;
+        }
+
+        std::istringstream af(script);
+        std::string line;
+        while (std::getline(af, line))
+        {
+            if(line.length() > 0 and line[line.length()-1] == '\r')
+                line.pop_back();
+            if(line.length() == 0)
+                continue;
+
+            std::vector<segment> segments(1);
+            for(size_t i = 0; i < line.length(); i++)
+            {
+                int found = -1;
+                if(line[i] == '$')
+                {
+                    for(int v = 0; v < VAR_COUNT; v++)
+                        if(line.compare(i, strlen(variable_names[v]), variable_names[v]) == 0)
+                            found = v;
+                }
+                if(found < 0)
+                {
+                    segments.back().literal += line[i];
+                    continue;
+                }
+                segments.back().variable = found;
+                uses[found] = true;
+                segments.emplace_back();
+                i += strlen(variable_names[found])-1;
+            }
+            lines.push_back(segments);
+        }
+    }
+    std::string expand(size_t line, const std::string * values) const
+    {
+        std::string out;
+        for(const auto & s : lines[line])
+        {
+            out += s.literal;
+            if(s.variable >= 0)
+                out += values[s.variable];
+        }
+        return out;
+    }
+};
+
+// parsed scripts by their contents; the file is still read every time, so edits apply right away
+static std::mutex templatesmutex;
+static std::map<std::string, std::shared_ptr<const ocrtemplate>> templates;
+
+static std::shared_ptr<const ocrtemplate> load_template(const char * commandfilename)
+{
+    std::string script;
+    if(!read_script(commandfilename, script)) return nullptr;
+
+    std::lock_guard<std::mutex> lock(templatesmutex);
+    auto & parsed = templates[script];
+    if(!parsed)
+        parsed = std::make_shared<const ocrtemplate>(script);
+    return parsed;
+}
+
+bool ocr_wants_files(const char * commandfilename)
+{
+    auto parsed = load_template(commandfilename);
+    if(!parsed) return true;
+    return parsed->uses[VAR_SCREENSHOT] or parsed->uses[VAR_OUTPUTFILE];
+}
+
+// how one process of a command line went
+struct stagereport {
+    std::string command;
+    int status = -1; // exit code, or -1 if it couldn't be started or was killed
+    double seconds = 0;
+};
+
+static void print_reports(const std::vector<stagereport> & reports)
+{
+    for(const auto & r : reports)
+        printf("  [%d] %.3fs %s\n", r.status, r.seconds, r.command.data());
+}
+
+#ifndef _WIN32
+
+// splits a command line into the words of each stage of a pipeline, like sh would
+// returns false if it uses anything besides words, quotes and | (redirection, globs, variables, etc.), which gets left to sh instead
+static bool split_pipeline(const std::string & line, std::vector<std::vector<std::string>> & stages)
+{
+    stages.clear();
+    stages.emplace_back();
+    std::string word;
+    bool inword = false;
+    for(size_t i = 0; i < line.length(); i++)
+    {
+        char c = line[i];
+        if(c == '\'')
+        {
+            auto end = line.find('\'', i+1);
+            if(end == std::string::npos) return false;
+            word += line.substr(i+1, end-i-1);
+            i = end;
+            inword = true;
+        }
+        else if(c == '"')
+        {
+            for(i++; i < line.length() and line[i] != '"'; i++)
+            {
+                char d = line[i];
+                if(d == '$' or d == '`') return false;
+                if(d == '\\' and i+1 < line.length() and (line[i+1] == '"' or line[i+1] == '\\'))
+                    d = line[++i];
+                word += d;
+            }
+            if(i >= line.length()) return false;
+            inword = true;
+        }
+        else if(c == '\\')
+        {
+            if(i+1 >= line.length()) return false;
+            word += line[++i];
+            inword = true;
+        }
+        else if(c == ' ' or c == '\t' or c == '|')
+        {
+            if(inword)
+                stages.back().push_back(word);
+            word.clear();
+            inword = false;
+            if(c == '|')
+            {
+                if(stages.back().empty()) return false;
+                stages.emplace_back();
+            }
+        }
+        else if(strchr("<>&;()`$*?[]{}~#\n", c))
+            return false;
+        else
+        {
+            word += c;
+            inword = true;
+        }
+    }
+    if(inword)
+        stages.back().push_back(word);
+    for(const auto & stage : stages)
+    {
+        // leading VAR=value assignments are for sh too
+        if(stage.empty() or stage[0].find('=') != std::string::npos)
+            return false;
+    }
+    return true;
+}
+
+#endif
+
+// runs one command line until it exits or the deadline passes
+// input (if not null) goes to its stdin and its stdout is collected into output (if not null); otherwise they're shared with nezuyomi
+// returns the exit code of the last stage of the pipeline, or -1 if it couldn't be started or had to be stopped
+static int run_line(const std::string & line, const unsigned char * input, size_t inputlen, std::string * output, const ocrdeadline & deadline, std::vector<stagereport> & reports)
+{
+    auto start = ocrclock::now();
+    bool stopped = false;
+
+    #ifdef _WIN32
+
+    std::string commandline = "cmd.exe /d /s /c \"" + line + "\"";
+    stagereport report;
+    report.command = line;
+
+    int status;
+    wchar_t * wcommand = (wchar_t *)utf8_to_utf16((uint8_t *)commandline.data(), &status);
+    if(!wcommand) return -1;
+
+    HANDLE in_read = nullptr, in_write = nullptr, out_read = nullptr, out_write = nullptr;
+    if(input and !CreatePipe(&in_read, &in_write, nullptr, 0))
+    {
+        free(wcommand);
+        return -1;
+    }
+    if(output and !CreatePipe(&out_read, &out_write, nullptr, 0))
+    {
+        if(in_read) CloseHandle(in_read);
+        if(in_write) CloseHandle(in_write);
+        free(wcommand);
+        return -1;
+    }
+
+    // everything the script starts goes in a job object, so that stopping it doesn't leave a recognizer running
+    HANDLE job = CreateJobObjectW(nullptr, nullptr);
+    PROCESS_INFORMATION process = {};
+    BOOL started;
+    {
+        // the child's ends are only inheritable while it's being created, so that children started by other OCR jobs don't hold onto them
+        static std::mutex spawnmutex;
+        std::lock_guard<std::mutex> lock(spawnmutex);
+        if(in_read) SetHandleInformation(in_read, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        if(out_write) SetHandleInformation(out_write, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+
+        STARTUPINFOW startup = {};
+        startup.cb = sizeof(startup);
+        startup.dwFlags = STARTF_USESTDHANDLES;
+        startup.hStdInput = input ? in_read : GetStdHandle(STD_INPUT_HANDLE);
+        startup.hStdOutput = output ? out_write : GetStdHandle(STD_OUTPUT_HANDLE);
+        startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        started = CreateProcessW(nullptr, wcommand, nullptr, nullptr, TRUE, CREATE_SUSPENDED, nullptr, nullptr, &startup, &process);
+        if(started)
+        {
+            if(job) AssignProcessToJobObject(job, process.hProcess);
+            ResumeThread(process.hThread);
+            CloseHandle(process.hThread);
+        }
+    }
+    if(in_read) CloseHandle(in_read);
+    if(out_write) CloseHandle(out_write);
+    free(wcommand);
+    if(!started)
+    {
+        if(in_write) CloseHandle(in_write);
+        if(out_read) CloseHandle(out_read);
+        if(job) CloseHandle(job);
+        puts("failed to start OCR command");
+        reports.push_back(report);
+        return -1;
+    }
+
+    // the pipes get their own threads, so that a script that starts writing before it's done reading can't deadlock with us
+    std::thread writer, reader;
+    if(input)
+    {
+        writer = std::thread([&](){
+            size_t done = 0;
+            while(done < inputlen)
+            {
+                DWORD written = 0;
+                DWORD chunk = DWORD(std::min(inputlen-done, size_t(1<<20)));
+                if(!WriteFile(in_write, input+done, chunk, &written, nullptr))
+                    break;
+                done += written;
+            }
+            CloseHandle(in_write);
+        });
+    }
+    if(output)
+    {
+        reader = std::thread([&](){
+            char buffer[4096];
+            DWORD got;
+            while(ReadFile(out_read, buffer, sizeof(buffer), &got, nullptr) and got > 0)
+                output->append(buffer, got);
+        });
+    }
+
+    while(WaitForSingleObject(process.hProcess, 20) == WAIT_TIMEOUT)
+    {
+        if(!stopped and deadline.expired())
+        {
+            if(job) TerminateJobObject(job, 1);
+            else TerminateProcess(process.hProcess, 1);
+            stopped = true;
+        }
+    }
+    // stray grandchildren can keep the pipes open
+    if(job) TerminateJobObject(job, 1);
+    if(writer.joinable()) writer.join();
+    if(reader.joinable()) reader.join();
+    if(out_read) CloseHandle(out_read);
+
+    DWORD exitcode = 1;
+    GetExitCodeProcess(process.hProcess, &exitcode);
+    CloseHandle(process.hProcess);
+    if(job) CloseHandle(job);
+
+    report.status = stopped ? -1 : int(exitcode);
+    report.seconds = seconds_since(start);
+    reports.push_back(report);
+    return report.status;
+
+    #else
+
+    // simple pipelines are started directly; anything else needs a shell
+    std::vector<std::vector<std::string>> stages;
+    if(!split_pipeline(line, stages))
+        stages = {{"/bin/sh", "-c", line}};
+
+    // close-on-exec, so that children started by other OCR jobs don't hold onto these
+    int in[2] = {-1, -1}, out[2] = {-1, -1};
+    if(input and pipe2(in, O_CLOEXEC) != 0)
+        return -1;
+    if(output and pipe2(out, O_CLOEXEC) != 0)
+    {
+        if(in[0] >= 0) close(in[0]);
+        if(in[1] >= 0) close(in[1]);
+        return -1;
+    }
+
+    std::vector<pid_t> pids(stages.size(), -1);
+    pid_t group = 0;
+    int previous = in[0]; // what the next stage reads from
+    for(size_t i = 0; i < stages.size(); i++)
+    {
+        bool last = i+1 == stages.size();
+        int next[2] = {-1, -1};
+        if(!last and pipe2(next, O_CLOEXEC) != 0)
+            break;
+        int stdout_fd = last ? out[1] : next[1];
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if(previous >= 0)
+            posix_spawn_file_actions_adddup2(&actions, previous, 0);
+        if(stdout_fd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, stdout_fd, 1);
+
+        // the whole pipeline shares a process group, so that it can be stopped all at once
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, group);
+
+        std::vector<char *> argv;
+        for(auto & word : stages[i])
+            argv.push_back((char *)word.data());
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        int error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv.data(), environ);
+        posix_spawnattr_destroy(&attributes);
+        posix_spawn_file_actions_destroy(&actions);
+
+        if(previous >= 0)
+            close(previous);
+        if(next[1] >= 0)
+            close(next[1]);
+        previous = next[0];
+
+        if(error == 0)
+        {
+            pids[i] = pid;
+            if(group == 0)
+                group = pid;
+        }
+        else
+            printf("couldn't start %s: %s\n", argv[0], strerror(error));
+    }
+    if(previous >= 0)
+        close(previous);
+    if(out[1] >= 0)
+        close(out[1]);
+
+    auto stop = [&]()
+    {
+        if(!stopped and group != 0)
+            kill(-group, SIGKILL);
+        stopped = true;
+    };
+
+    // written from another thread, so that a script that starts writing before it's done reading can't deadlock with us
+    std::thread writer;
+    if(input)
+    {
+        writer = std::thread([&](){
+            size_t done = 0;
+            while(done < inputlen)
+            {
+                ssize_t written = write(in[1], input+done, inputlen-done);
+                if(written < 0)
+                {
+                    if(errno == EINTR) continue;
+                    break;
+                }
+                done += written;
+            }
+            close(in[1]);
+        });
+    }
+
+    if(output)
+    {
+        char buffer[4096];
+        while(true)
+        {
+            if(deadline.expired())
+                stop();
+            pollfd p = {out[0], POLLIN, 0};
+            int ready = poll(&p, 1, 20);
+            if(ready < 0 and errno != EINTR)
+                break;
+            if(ready <= 0)
+                continue;
+            ssize_t got = read(out[0], buffer, sizeof(buffer));
+            if(got < 0 and errno == EINTR) continue;
+            if(got <= 0) break;
+            output->append(buffer, got);
+        }
+        close(out[0]);
+    }
+
+    std::vector<stagereport> stagereports(stages.size());
+    size_t running = 0;
+    for(size_t i = 0; i < stages.size(); i++)
+    {
+        for(const auto & word : stages[i])
+            stagereports[i].command += (stagereports[i].command.length() ? " " : "") + word;
+        if(pids[i] > 0)
+            running++;
+        else
+            stagereports[i].status = 127;
+    }
+    // reaped in whatever order they exit, so that each stage gets its own time
+    while(running > 0)
+    {
+        int status = 0;
+        pid_t done = waitpid(-group, &status, WNOHANG);
+        if(done < 0)
+        {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(done == 0)
+        {
+            if(deadline.expired())
+                stop();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        for(size_t i = 0; i < stages.size(); i++)
+        {
+            if(pids[i] != done)
+                continue;
+            stagereports[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            stagereports[i].seconds = seconds_since(start);
+            running--;
+        }
+    }
+    reports.insert(reports.end(), stagereports.begin(), stagereports.end());
+    if(writer.joinable())
+        writer.join();
+
+    return stopped ? -1 : stagereports.back().status;
+
+    #endif
+}
+
+// tells the user why a run failed, along with how each process went
+static void finish_run(const ocrdeadline & deadline, int status, const std::vector<stagereport> & reports, ocrclock::time_point start)
+{
+    if(deadline.cancelled())
+        puts("OCR was cancelled");
+    else if(status == -1 and deadline.expired())
+        puts("OCR timed out");
+    printf("done running OCR in %.3fs\n", seconds_since(start));
+    print_reports(reports);
+}
+
+int ocr(const char * filename, const char * commandfilename, const char * outfilename, const char * scale, const char * xshear, const char * yshear, const ocrlimits & limits)
+{
+    auto parsed = load_template(commandfilename);
+    if(!parsed) return 1;
+
+    std::string values[VAR_COUNT];
+    values[VAR_SCREENSHOT] = filename;
+    values[VAR_OUTPUTFILE] = outfilename;
+    values[VAR_SCALE] = scale;
+    values[VAR_XSHEAR] = xshear;
+    values[VAR_YSHEAR] = yshear;
+
+    ocrdeadline deadline(limits);
+    auto start = ocrclock::now();
+    std::vector<stagereport> reports;
+    int status = 0;
+
     puts("running OCR");
-    while (std::getline(af, line))
+    for(size_t i = 0; i < parsed->lines.size(); i++)
+    {
+        auto line = parsed->expand(i, values);
+        puts(line.data());
+        status = run_line(line, nullptr, 0, nullptr, deadline, reports);
+        // later lines usually work on what earlier ones made, so there's no point going on after giving up
+        if(deadline.expired())
+            break;
+    }
+    finish_run(deadline, status, reports, start);
+
+    // like sh, only the last line decides; earlier lines that failed show up in the stage reports
+    if(deadline.expired())
+        return 1;
+    return status;
+}
+
+// a long-running child process with pipes to its stdin and stdout, used for "server:" engines
+struct childprocess {
+    #ifdef _WIN32
+    HANDLE process = nullptr;
+    HANDLE job = nullptr;
+    HANDLE input = nullptr, output = nullptr;
+    #else
+    pid_t pid = -1;
+    int input = -1, output = -1;
+    #endif
+};
+
+// command is a shell command line; returns false if it couldn't be started
+static bool child_start(const std::string & command, childprocess * child)
+{
+    #ifdef _WIN32
+
+    std::string commandline = "cmd.exe /d /s /c \"" + command + "\"";
+
+    int status;
+    wchar_t * wcommand = (wchar_t *)utf8_to_utf16((uint8_t *)commandline.data(), &status);
+    if(!wcommand) return false;
+
+    HANDLE in_read, in_write, out_read, out_write;
+    if(!CreatePipe(&in_read, &in_write, nullptr, 0))
+    {
+        free(wcommand);
+        return false;
+    }
+    if(!CreatePipe(&out_read, &out_write, nullptr, 0))
+    {
+        CloseHandle(in_read);
+        CloseHandle(in_write);
+        free(wcommand);
+        return false;
+    }
+
+    HANDLE job = CreateJobObjectW(nullptr, nullptr);
+    PROCESS_INFORMATION process = {};
+    BOOL started;
+    {
+        static std::mutex spawnmutex;
+        std::lock_guard<std::mutex> lock(spawnmutex);
+        SetHandleInformation(in_read, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        SetHandleInformation(out_write, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+
+        STARTUPINFOW startup = {};
+        startup.cb = sizeof(startup);
+        startup.dwFlags = STARTF_USESTDHANDLES;
+        startup.hStdInput = in_read;
+        startup.hStdOutput = out_write;
+        startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        started = CreateProcessW(nullptr, wcommand, nullptr, nullptr, TRUE, CREATE_SUSPENDED, nullptr, nullptr, &startup, &process);
+        if(started)
+        {
+            if(job) AssignProcessToJobObject(job, process.hProcess);
+            ResumeThread(process.hThread);
+            CloseHandle(process.hThread);
+        }
+    }
+    CloseHandle(in_read);
+    CloseHandle(out_write);
+    free(wcommand);
+    if(!started)
+    {
+        CloseHandle(in_write);
+        CloseHandle(out_read);
+        if(job) CloseHandle(job);
+        puts("failed to start OCR engine");
+        return false;
+    }
+
+    child->process = process.hProcess;
+    child->job = job;
+    child->input = in_write;
+    child->output = out_read;
+    return true;
+
+    #else
+
+    int in[2], out[2];
+    if(pipe2(in, O_CLOEXEC) != 0) return false;
+    if(pipe2(out, O_CLOEXEC) != 0)
+    {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+
+    // in its own process group, so that killing it also gets anything it started
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+
+    char * args[] = {(char *)"sh", (char *)"-c", (char *)command.data(), nullptr};
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", &actions, &attributes, args, environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in[0]);
+    close(out[1]);
+    if(error)
+    {
+        close(in[1]);
+        close(out[0]);
+        puts("failed to start OCR engine");
+        return false;
+    }
+
+    // non-blocking, so that writing to an engine that stopped reading can still give up when the deadline passes
+    fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+
+    child->pid = pid;
+    child->input = in[1];
+    child->output = out[0];
+    return true;
+
+    #endif
+}
+// returns false if the child stopped reading or the deadline passed first
+static bool child_write(childprocess * child, const void * data, size_t len, const ocrdeadline & deadline)
+{
+    auto bytes = (const unsigned char *)data;
+
+    #ifdef _WIN32
+
+    // anonymous pipes can't be waited on for writing, so the write gets its own thread, which killing the child unblocks
+    std::atomic<int> result(-1); // -1 while writing, then 0 or 1
+    std::thread writer([&](){
+        size_t done = 0;
+        while(done < len)
+        {
+            DWORD written = 0;
+            DWORD chunk = DWORD(std::min(len-done, size_t(1<<20)));
+            if(!WriteFile(child->input, bytes+done, chunk, &written, nullptr))
+                break;
+            done += written;
+        }
+        result.store(done == len ? 1 : 0);
+    });
+    bool stopped = false;
+    while(result.load() < 0)
+    {
+        if(!stopped and deadline.expired())
+        {
+            if(child->job) TerminateJobObject(child->job, 1);
+            else TerminateProcess(child->process, 1);
+            stopped = true;
+        }
+        Sleep(5);
+    }
+    writer.join();
+    return result.load() == 1 and !stopped;
+
+    #else
+
+    size_t done = 0;
+    while(done < len)
+    {
+        if(deadline.expired())
+            return false;
+        pollfd p = {child->input, POLLOUT, 0};
+        int ready = poll(&p, 1, 20);
+        if(ready < 0 and errno != EINTR)
+            return false;
+        if(ready <= 0)
+            continue;
+        ssize_t written = write(child->input, bytes+done, len-done);
+        if(written < 0)
+        {
+            if(errno == EINTR or errno == EAGAIN or errno == EWOULDBLOCK) continue;
+            return false;
+        }
+        done += written;
+    }
+    return true;
+
+    #endif
+}
+// reads exactly len bytes; returns false if the child closed its stdout or the deadline passed first
+static bool child_read_exact(childprocess * child, void * buffer, size_t len, const ocrdeadline & deadline)
+{
+    auto bytes = (unsigned char *)buffer;
+    size_t done = 0;
+    while(done < len)
     {
+        if(deadline.expired())
+            return false;
+
         #ifdef _WIN32
-        
-        int status;
-        wchar_t * wcommand = (wchar_t *)utf8_to_utf16((uint8_t *)line.data(), &status);
-        if(wcommand)
+        DWORD available = 0;
+        if(!PeekNamedPipe(child->output, nullptr, 0, nullptr, &available, nullptr))
+            return false;
+        if(available == 0)
         {
-            _putws(wcommand);
-            puts("");
-            _wsystem(wcommand);
+            Sleep(5);
+            continue;
         }
-        free(wcommand);
-        
+        DWORD got = 0;
+        if(!ReadFile(child->output, bytes+done, DWORD(std::min(size_t(available), len-done)), &got, nullptr) or got == 0)
+            return false;
         #else
-        
-        system(line.data());
-        
+        pollfd p = {child->output, POLLIN, 0};
+        int ready = poll(&p, 1, 20);
+        if(ready < 0 and errno != EINTR)
+            return false;
+        if(ready <= 0)
+            continue;
+        ssize_t got = read(child->output, bytes+done, len-done);
+        if(got < 0 and errno == EINTR) continue;
+        if(got <= 0) return false;
         #endif
+        done += got;
     }
-    puts("done running OCR");
-    //fclose(f);
-    
-    return 0;
+    return true;
+}
+// closes the pipes and makes sure the child is gone, killing it if it hasn't exited by itself
+static void child_finish(childprocess * child, bool kill_it)
+{
+    #ifdef _WIN32
+    if(kill_it and child->job) TerminateJobObject(child->job, 1);
+    CloseHandle(child->input);
+    CloseHandle(child->output);
+    WaitForSingleObject(child->process, INFINITE);
+    CloseHandle(child->process);
+    if(child->job) CloseHandle(child->job);
+    *child = childprocess();
+    #else
+    if(kill_it) kill(-child->pid, SIGKILL);
+    close(child->input);
+    close(child->output);
+    int status;
+    while(waitpid(child->pid, &status, 0) < 0 and errno == EINTR);
+    *child = childprocess();
+    #endif
+}
+
+// engines started by "server:" scripts, kept running between requests
+// protocol, all integers little endian u32:
+// request:  "NZOQ", parameter length, parameters ("SCALE=...\nXSHEAR=...\nYSHEAR=...\n"), image length, image (png)
+// response: "NZOR", status (0 on success), text length, text (utf-8)
+struct ocrengine {
+    std::mutex mutex; // one request at a time
+    childprocess child;
+    bool running = false;
+};
+static std::mutex enginesmutex;
+static std::map<std::string, ocrengine *> engines;
+
+static void put_u32(std::string & out, uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        out += char((value >> (i*8)) & 0xFF);
+}
+static uint32_t get_u32(const unsigned char * in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | (uint32_t(in[3]) << 24);
+}
+
+// one round trip with the engine; false if it broke the protocol, went away, or didn't answer in time
+static bool engine_request(ocrengine * engine, const std::string & parameters, const unsigned char * input, size_t inputlen, std::string * output, uint32_t * status, const ocrdeadline & deadline)
+{
+    std::string header = "NZOQ";
+    put_u32(header, parameters.length());
+    header += parameters;
+    put_u32(header, inputlen);
+    if(!child_write(&engine->child, header.data(), header.length(), deadline) or !child_write(&engine->child, input, inputlen, deadline))
+        return false;
+
+    unsigned char response[12];
+    if(!child_read_exact(&engine->child, response, 12, deadline) or memcmp(response, "NZOR", 4) != 0)
+        return false;
+    *status = get_u32(response+4);
+    uint32_t len = get_u32(response+8);
+
+    output->resize(len);
+    return len == 0 or child_read_exact(&engine->child, &(*output)[0], len, deadline);
+}
+
+static int ocr_server(const std::string & command, const unsigned char * input, size_t inputlen, std::string * output, const char * scale, const char * xshear, const char * yshear, const ocrdeadline & deadline)
+{
+    ocrengine * engine;
+    {
+        std::lock_guard<std::mutex> lock(enginesmutex);
+        if(engines.count(command) == 0)
+            engines[command] = new ocrengine;
+        engine = engines[command];
+    }
+
+    std::string parameters = std::string("SCALE=") + scale + "\nXSHEAR=" + xshear + "\nYSHEAR=" + yshear + "\n";
+
+    // waiting behind another request counts against this one's deadline too
+    std::unique_lock<std::mutex> lock(engine->mutex, std::defer_lock);
+    while(!lock.try_lock())
+    {
+        if(deadline.expired())
+        {
+            puts(deadline.cancelled() ? "OCR was cancelled while waiting for the engine" : "OCR timed out while waiting for the engine");
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    auto start = ocrclock::now();
+    // an engine that died gets one restart per request
+    for(int attempt = 0; attempt < 2 and !deadline.expired(); attempt++)
+    {
+        if(!engine->running)
+        {
+            puts("starting OCR engine");
+            puts(command.data());
+            if(!child_start(command, &engine->child))
+                return 1;
+            engine->running = true;
+        }
+
+        uint32_t status = 0;
+        if(engine_request(engine, parameters, input, inputlen, output, &status, deadline))
+        {
+            printf("OCR engine answered in %.3fs with status %d\n", seconds_since(start), int(status));
+            return status == 0 ? 0 : 1;
+        }
+
+        // a half-answered request would leave the next one reading the rest of this one's response
+        output->clear();
+        child_finish(&engine->child, true);
+        engine->running = false;
+
+        if(deadline.cancelled())
+            puts("OCR was cancelled, stopped the engine");
+        else if(deadline.expired())
+            puts("OCR engine timed out, stopped it");
+        else
+            puts("OCR engine went away, restarting it");
+    }
+    return 1;
+}
+
+int ocr_piped(const char * commandfilename, const unsigned char * input, size_t inputlen, std::string * output, const char * scale, const char * xshear, const char * yshear, const ocrlimits & limits)
+{
+    auto parsed = load_template(commandfilename);
+    if(!parsed) return 1;
+
+    ocrdeadline deadline(limits);
+
+    if(parsed->server.length() > 0)
+        return ocr_server(parsed->server, input, inputlen, output, scale, xshear, yshear, deadline);
+
+    std::string values[VAR_COUNT];
+    values[VAR_SCALE] = scale;
+    values[VAR_XSHEAR] = xshear;
+    values[VAR_YSHEAR] = yshear;
+
+    // the whole script is one command, so that its first line gets the image and its last line's output is the text
+    std::string command;
+    for(size_t i = 0; i < parsed->lines.size(); i++)
+    {
+        if(i > 0)
+        {
+            #ifdef _WIN32
+            // cmd only takes one line
+            command += " & ";
+            #else
+            command += "\n";
+            #endif
+        }
+        command += parsed->expand(i, values);
+    }
+
+    puts("running OCR through pipes");
+    puts(command.data());
+
+    auto start = ocrclock::now();
+    std::vector<stagereport> reports;
+    int status = run_line(command, input, inputlen, output, deadline, reports);
+    finish_run(deadline, status, reports, start);
+
+    return status == 0 ? 0 : 1;
 }
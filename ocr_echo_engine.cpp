@@ -0,0 +1,79 @@
+// reference engine for nezuyomi's "server:" OCR scripts
+// doesn't do any OCR: answers every request with a description of what it got, so the protocol can be tested without an OCR setup
+// build: g++ --std=c++17 ocr_echo_engine.cpp -o ocr_echo_engine
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+static bool read_exact(void * buffer, size_t len)
+{
+    return fread(buffer, 1, len, stdin) == len;
+}
+static bool read_u32(uint32_t * value)
+{
+    unsigned char bytes[4];
+    if(!read_exact(bytes, 4)) return false;
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+    return true;
+}
+static void write_u32(uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+        fputc((value >> (i*8)) & 0xFF, stdout);
+}
+
+int main()
+{
+    #ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+    #endif
+
+    // nezuyomi closes our stdin when it's done with us
+    while(true)
+    {
+        char magic[4];
+        if(!read_exact(magic, 4)) return 0;
+        if(memcmp(magic, "NZOQ", 4) != 0)
+        {
+            fputs("ocr_echo_engine: bad request\n", stderr);
+            return 1;
+        }
+
+        uint32_t len;
+        if(!read_u32(&len)) return 1;
+        std::string parameters(len, 0);
+        if(len > 0 and !read_exact(&parameters[0], len)) return 1;
+
+        if(!read_u32(&len)) return 1;
+        std::vector<unsigned char> image(len);
+        if(len > 0 and !read_exact(image.data(), len)) return 1;
+
+        std::string text = "echo: " + std::to_string(image.size()) + " byte image";
+        // png dimensions are big endian, in the IHDR chunk right after the signature
+        if(image.size() >= 24 and memcmp(image.data()+1, "PNG", 3) == 0)
+        {
+            uint32_t w = (image[16] << 24) | (image[17] << 16) | (image[18] << 8) | image[19];
+            uint32_t h = (image[20] << 24) | (image[21] << 16) | (image[22] << 8) | image[23];
+            text += ", " + std::to_string(w) + "x" + std::to_string(h);
+        }
+        for(char & c : parameters)
+            if(c == '\n')
+                c = ' ';
+        text += "\n" + parameters;
+
+        fwrite("NZOR", 1, 4, stdout);
+        write_u32(0);
+        write_u32(text.length());
+        fwrite(text.data(), 1, text.length(), stdout);
+        fflush(stdout);
+    }
+}